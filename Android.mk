@@ -23,6 +23,7 @@ LOCAL_SRC_FILES := \
     prop.c \
     adb_install.c \
     verifier.c \
+    verifier_hash.c \
     ../../system/vold/vdc.c
 
 ADDITIONAL_RECOVERY_FILES := $(shell echo $$ADDITIONAL_RECOVERY_FILES)
@@ -180,7 +181,7 @@ include $(BUILD_PREBUILT)
 
 include $(CLEAR_VARS)
 
-LOCAL_SRC_FILES := verifier_test.c verifier.c
+LOCAL_SRC_FILES := verifier_test.c verifier.c verifier_hash.c
 
 LOCAL_C_INCLUDES += system/extras/ext4_utils system/core/fs_mgr/include
 
@@ -190,10 +191,79 @@ LOCAL_FORCE_STATIC_EXECUTABLE := true
 
 LOCAL_MODULE_TAGS := tests
 
-LOCAL_STATIC_LIBRARIES := libmincrypt libcutils libstdc++ libc
+LOCAL_STATIC_LIBRARIES := libmincrypt libminzip libcutils liblog libstdc++ libc
 
 include $(BUILD_EXECUTABLE)
 
+# Converts the dumpkey output that becomes /res/keys into the binary
+# key store recovery maps as /res/keys.bin.  The recovery image recipe
+# rebuilds $(TARGET_RECOVERY_OUT) from scratch, so the store is made
+# there, next to where it copies res/keys:
+#   $(call build-recovery-key-store,$(TARGET_RECOVERY_ROOT_OUT)/res)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := recovery_keystore.c verifier.c verifier_hash.c
+
+LOCAL_C_INCLUDES += system/core/fs_mgr/include
+
+LOCAL_MODULE := recovery_keystore
+
+LOCAL_STATIC_LIBRARIES := libmincrypt
+
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+RECOVERY_KEY_STORE_TOOL := $(LOCAL_INSTALLED_MODULE)
+
+define build-recovery-key-store
+  @echo "Key store: $(1)/keys.bin"
+  $(hide) $(RECOVERY_KEY_STORE_TOOL) $(1)/keys $(1)/keys.bin
+endef
+
+# INSTALLED_RECOVERYIMAGE_TARGET is only set later, in build/core/Makefile.
+$(PRODUCT_OUT)/recovery.img: $(RECOVERY_KEY_STORE_TOOL)
+
+# verifier throughput benchmark; run on the host, e.g.
+#   verifier_bench_sign -size 512 bootable/recovery/testdata/testkey.pk8:sha256 \
+#       /tmp/bench.zip /tmp/bench.keys
+#   verifier_bench /tmp/bench.zip /tmp/bench.keys
+# The signer links only libcrypto and the bench only libmincrypt, since
+# both define RSA_verify.
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+    verifier_bench.c \
+    verifier.c \
+    verifier_hash.c
+
+LOCAL_C_INCLUDES += \
+    system/core/fs_mgr/include
+
+LOCAL_MODULE := verifier_bench
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libmincrypt
+
+LOCAL_LDLIBS += -lpthread
+
+include $(BUILD_HOST_EXECUTABLE)
+
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := verifier_bench_sign.c
+
+LOCAL_C_INCLUDES += external/openssl/include
+
+LOCAL_MODULE := verifier_bench_sign
+
+LOCAL_MODULE_TAGS := tests
+
+LOCAL_STATIC_LIBRARIES := libcrypto_static
+
+include $(BUILD_HOST_EXECUTABLE)
+
 include $(commands_recovery_local_path)/bmlutils/Android.mk
 include $(commands_recovery_local_path)/dedupe/Android.mk
 include $(commands_recovery_local_path)/flashutils/Android.mk
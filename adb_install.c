@@ -33,6 +33,7 @@
 #include "recovery_ui.h"
 #include "adb_install.h"
 #include "minadbd/adb.h"
+#include "verifier.h"
 
 static void
 set_usb_driver(int enabled) {
@@ -105,11 +106,22 @@ apply_from_adb() {
     ui_print("\n\nSideload started ...\nNow send the package you want to apply\n"
               "to the device with \"adb sideload <filename>\"...\n\n");
 
+    // The child hands back the package's digest through this pipe once
+    // the whole package has arrived.
+    int digest_pipe[2];
+    if (pipe(digest_pipe) != 0) {
+        digest_pipe[0] = digest_pipe[1] = -1;
+    }
+
     struct sideload_waiter_data data;
     if ((data.child = fork()) == 0) {
-        execl("/sbin/recovery", "recovery", "adbd", NULL);
+        char fd_arg[16];
+        if (digest_pipe[0] >= 0) close(digest_pipe[0]);
+        snprintf(fd_arg, sizeof(fd_arg), "%d", digest_pipe[1]);
+        execl("/sbin/recovery", "recovery", "adbd", fd_arg, NULL);
         _exit(-1);
     }
+    if (digest_pipe[1] >= 0) close(digest_pipe[1]);
     
     pthread_t sideload_thread;
     pthread_create(&sideload_thread, NULL, &adb_sideload_thread, &data);
@@ -140,10 +152,20 @@ apply_from_adb() {
             ui_print("Error reading package:\n  %s\n", strerror(errno));
             ui_set_background(BACKGROUND_ICON_ERROR);
         }
+        if (digest_pipe[0] >= 0) close(digest_pipe[0]);
         return INSTALL_ERROR;
     }
 
-    int install_status = install_package(ADB_SIDELOAD_FILENAME);
+    VerifierDigest digest;
+    int have_digest = 0;
+    if (digest_pipe[0] >= 0) {
+        have_digest = TEMP_FAILURE_RETRY(read(digest_pipe[0], &digest,
+                                              sizeof(digest))) == sizeof(digest);
+        close(digest_pipe[0]);
+    }
+
+    int install_status = install_package_with_digest(ADB_SIDELOAD_FILENAME,
+                                                     have_digest ? &digest : NULL);
     ui_reset_progress();
 
     if (install_status != INSTALL_SUCCESS) {
@@ -19,10 +19,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
 #include <fcntl.h>
+#include <linux/fs.h>
 #include <unistd.h>
 
 #include "mincrypt/sha.h"
@@ -30,7 +33,10 @@
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadContents(const char* filename, FileContents* file,
+                        int retouch_flag, int map_ok);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map_ok);
 static ssize_t FileSink(unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
@@ -52,13 +58,22 @@ static int mtd_partitions_scanned = 0;
 // Return 0 on success.
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag) {
+    return LoadContents(filename, file, retouch_flag, 0);
+}
+
+// Like LoadFileContents, but if map_ok is set EMMC partitions are
+// mapped rather than copied into memory; release the result with
+// FreeFileContents().
+static int LoadContents(const char* filename, FileContents* file,
+                        int retouch_flag, int map_ok) {
     file->data = NULL;
+    file->map_length = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, map_ok);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -105,6 +120,49 @@ int LoadFileContents(const char* filename, FileContents* file,
     return 0;
 }
 
+void FreeFileContents(FileContents* file) {
+    if (file->map_length != 0) {
+        munmap(file->data, file->map_length);
+    } else {
+        free(file->data);
+    }
+    file->data = NULL;
+    file->map_length = 0;
+}
+
+// Map up to 'length' bytes of the file or block device open on 'fd'
+// read-only, stopping at its end.  Return NULL on failure; otherwise
+// set *mapped to the number of bytes mapped.
+static unsigned char* MapReadOnly(int fd, size_t length, size_t* mapped) {
+    struct stat st;
+    uint64_t end;
+    if (fstat(fd, &st) != 0) {
+        return NULL;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &end) != 0) {
+            return NULL;
+        }
+    } else if (S_ISREG(st.st_mode)) {
+        end = st.st_size;
+    } else {
+        return NULL;
+    }
+    if (length > end) length = end;
+    if (length == 0) {
+        return NULL;
+    }
+
+    void* addr = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        printf("failed to map %ld bytes: %s\n", (long)length, strerror(errno));
+        return NULL;
+    }
+    madvise(addr, length, MADV_SEQUENTIAL);
+    *mapped = length;
+    return addr;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -135,9 +193,13 @@ static int compare_size_indices(const void* a, const void* b) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
+//
+// If map_ok is set, an EMMC partition is mapped read-only and hashed in
+// place instead of being copied into memory.
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map_ok) {
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
 
@@ -225,8 +287,14 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
     SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
+    // map or allocate enough memory to hold the largest size.
+    if (type == EMMC && map_ok) {
+        file->data = MapReadOnly(fileno(dev), size[index[pairs-1]],
+                                 &file->map_length);
+    }
+    if (file->data == NULL) {
+        file->data = malloc(size[index[pairs-1]]);
+    }
     char* p = (char*)file->data;
     file->size = 0;                // # bytes read so far
 
@@ -243,14 +311,19 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                     break;
 
                 case EMMC:
-                    read = fread(p, 1, next, dev);
+                    if (file->map_length != 0) {
+                        // Already in place; just check there's that much.
+                        read = file->map_length - file->size;
+                        if (read > next) read = next;
+                    } else {
+                        read = fread(p, 1, next, dev);
+                    }
                     break;
             }
             if (next != read) {
                 printf("short read (%d bytes of %d) for partition \"%s\"\n",
                        read, next, partition);
-                free(file->data);
-                file->data = NULL;
+                FreeFileContents(file);
                 return -1;
             }
             SHA_update(&sha_ctx, p, read);
@@ -266,8 +339,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         if (ParseSha1(sha1sum[index[i]], parsed_sha) != 0) {
             printf("failed to parse sha1 %s in %s\n",
                    sha1sum[index[i]], filename);
-            free(file->data);
-            file->data = NULL;
+            FreeFileContents(file);
             return -1;
         }
 
@@ -298,8 +370,7 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         // finding a match.
         printf("contents of partition \"%s\" didn't match %s\n",
                partition, filename);
-        free(file->data);
-        file->data = NULL;
+        FreeFileContents(file);
         return -1;
     }
 
@@ -355,181 +426,211 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return 0;
 }
 
-// Write a memory buffer to 'target' partition, a string of the form
-// "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
-// success.
-int WriteToPartition(unsigned char* data, size_t len,
-                        const char* target) {
-    char* copy = strdup(target);
-    const char* magic = strtok(copy, ":");
-
+// Writes patched output to a 'target' partition, a string of the form
+// "MTD:<partition>[:...]" or "EMMC:<partition_device>:", as it is
+// produced, so the whole image never has to be held in memory.  At
+// most 'size' bytes are accepted.
+typedef struct {
     enum PartitionType type;
-    if (strcmp(magic, "MTD") == 0) {
-        type = MTD;
-    } else if (strcmp(magic, "EMMC") == 0) {
-        type = EMMC;
+    char* copy;                 // target string, split in place
+    const char* partition;
+    MtdWriteContext* mtd;
+    int fd;
+    size_t size;
+    size_t written;
+    size_t next_sync;
+} PartitionWriter;
+
+// Return 0 on success.
+static int OpenPartitionWriter(const char* target, size_t size,
+                               PartitionWriter* pw) {
+    pw->copy = strdup(target);
+    pw->mtd = NULL;
+    pw->fd = -1;
+    pw->size = size;
+    pw->written = 0;
+    pw->next_sync = 1<<20;
+
+    const char* magic = strtok(pw->copy, ":");
+    if (magic != NULL && strcmp(magic, "MTD") == 0) {
+        pw->type = MTD;
+    } else if (magic != NULL && strcmp(magic, "EMMC") == 0) {
+        pw->type = EMMC;
     } else {
-        printf("WriteToPartition called with bad target (%s)\n", target);
+        printf("OpenPartitionWriter called with bad target (%s)\n", target);
+        free(pw->copy);
         return -1;
     }
-    const char* partition = strtok(NULL, ":");
+    pw->partition = strtok(NULL, ":");
 
-    if (partition == NULL) {
+    if (pw->partition == NULL) {
         printf("bad partition target name \"%s\"\n", target);
+        free(pw->copy);
         return -1;
     }
 
-    switch (type) {
+    switch (pw->type) {
         case MTD:
             if (!mtd_partitions_scanned) {
                 mtd_scan_partitions();
                 mtd_partitions_scanned = 1;
             }
 
-            const MtdPartition* mtd = mtd_find_partition_by_name(partition);
+            const MtdPartition* mtd = mtd_find_partition_by_name(pw->partition);
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found for writing\n",
-                       partition);
+                       pw->partition);
+                free(pw->copy);
                 return -1;
             }
 
-            MtdWriteContext* ctx = mtd_write_partition(mtd);
-            if (ctx == NULL) {
+            pw->mtd = mtd_write_partition(mtd);
+            if (pw->mtd == NULL) {
                 printf("failed to init mtd partition \"%s\" for writing\n",
-                       partition);
+                       pw->partition);
+                free(pw->copy);
                 return -1;
             }
+            break;
 
-            size_t written = mtd_write_data(ctx, (char*)data, len);
-            if (written != len) {
-                printf("only wrote %d of %d bytes to MTD %s\n",
-                       written, len, partition);
-                mtd_write_close(ctx);
+        case EMMC:
+            pw->fd = open(pw->partition, O_RDWR);
+            if (pw->fd < 0) {
+                printf("failed to open %s: %s\n", pw->partition, strerror(errno));
+                free(pw->copy);
                 return -1;
             }
+            break;
+    }
+    return 0;
+}
 
-            if (mtd_erase_blocks(ctx, -1) < 0) {
-                printf("error finishing mtd write of %s\n", partition);
-                mtd_write_close(ctx);
-                return -1;
-            }
+static ssize_t PartitionSink(unsigned char* data, ssize_t len, void* token) {
+    PartitionWriter* pw = (PartitionWriter*)token;
+    if (pw->size - pw->written < (size_t)len) {
+        printf("patch output for %s is larger than %ld bytes\n",
+               pw->partition, (long)pw->size);
+        return -1;
+    }
 
-            if (mtd_write_close(ctx)) {
-                printf("error closing mtd write of %s\n", partition);
+    switch (pw->type) {
+        case MTD:
+            if (mtd_write_data(pw->mtd, (char*)data, len) != len) {
+                printf("failed writing %ld bytes at %ld to MTD %s\n",
+                       (long)len, (long)pw->written, pw->partition);
                 return -1;
             }
+            pw->written += len;
             break;
 
         case EMMC:
         {
-            size_t start = 0;
-            int success = 0;
-            int fd = open(partition, O_RDWR);
-            if (fd < 0) {
-                printf("failed to open %s: %s\n", partition, strerror(errno));
-                return -1;
-            }
-            int attempt;
-
-            for (attempt = 0; attempt < 10; ++attempt) {
-                size_t next_sync = start + (1<<20);
-                printf("raw write %s attempt %d start at %d\n", partition, attempt+1, start);
-                lseek(fd, start, SEEK_SET);
-                while (start < len) {
-                    size_t to_write = len - start;
-                    if (to_write > 4096) to_write = 4096;
-
-                    ssize_t written = write(fd, data+start, to_write);
-                    if (written < 0) {
-                        if (errno == EINTR) {
-                            written = 0;
-                        } else {
-                            printf("failed write writing to %s (%s)\n",
-                                   partition, strerror(errno));
-                            return -1;
-                        }
-                    }
-                    start += written;
-                    if (start >= next_sync) {
-                        fsync(fd);
-                        next_sync = start + (1<<20);
-                    }
+            ssize_t done = 0;
+            while (done < len) {
+                ssize_t wrote = write(pw->fd, data+done, len-done);
+                if (wrote < 0) {
+                    if (errno == EINTR) continue;
+                    printf("failed write writing to %s (%s)\n",
+                           pw->partition, strerror(errno));
+                    return -1;
                 }
-                fsync(fd);
+                done += wrote;
+            }
+            pw->written += len;
+            if (pw->written >= pw->next_sync) {
+                fsync(pw->fd);
+                pw->next_sync = pw->written + (1<<20);
+            }
+            break;
+        }
+    }
+    return len;
+}
 
-                // drop caches so our subsequent verification read
-                // won't just be reading the cache.
-                sync();
-                int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
-                write(dc, "3\n", 2);
-                close(dc);
-                sleep(1);
-                printf("  caches dropped\n");
-
-                // verify
-                lseek(fd, 0, SEEK_SET);
-                unsigned char buffer[4096];
-                start = len;
-                size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
-                    size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count = read(fd, buffer+so_far, to_read-so_far);
-                        if (read_count < 0) {
-                            if (errno == EINTR) {
-                                read_count = 0;
-                            } else {
-                                printf("verify read error %s at %d: %s\n",
-                                       partition, p, strerror(errno));
-                                return -1;
-                            }
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %d: %d %d %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
-                    }
+// Finish writing the partition.  For EMMC, if 'sha1' is not NULL, read
+// everything back past the page cache and check that it hashes to
+// 'sha1'; MTD writes are already verified block by block as they go.
+// Return 0 on success.
+static int ClosePartitionWriter(PartitionWriter* pw,
+                                const uint8_t sha1[SHA_DIGEST_SIZE]) {
+    int result = 0;
 
-                    if (memcmp(buffer, data+p, to_read)) {
-                        printf("verification failed starting at %d\n", p);
-                        start = p;
-                        break;
-                    }
-                }
+    switch (pw->type) {
+        case MTD:
+            if (mtd_erase_blocks(pw->mtd, -1) < 0) {
+                printf("error finishing mtd write of %s\n", pw->partition);
+                result = -1;
+            }
+            if (mtd_write_close(pw->mtd)) {
+                printf("error closing mtd write of %s\n", pw->partition);
+                result = -1;
+            }
+            break;
+
+        case EMMC:
+        {
+            fsync(pw->fd);
+            if (sha1 == NULL) {
+                close(pw->fd);
+                break;
+            }
 
-                if (start == len) {
-                    printf("verification read succeeded (attempt %d)\n", attempt+1);
-                    success = true;
+            // drop caches so our verification read won't just be
+            // reading the cache.
+            sync();
+            int dc = open("/proc/sys/vm/drop_caches", O_WRONLY);
+            write(dc, "3\n", 2);
+            close(dc);
+            sleep(1);
+            printf("  caches dropped\n");
+
+            // verify
+            SHA_CTX ctx;
+            SHA_init(&ctx);
+            lseek(pw->fd, 0, SEEK_SET);
+            unsigned char buffer[4096];
+            size_t p = 0;
+            while (p < pw->written) {
+                size_t to_read = pw->written - p;
+                if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
+
+                ssize_t read_count = read(pw->fd, buffer, to_read);
+                if (read_count < 0 && errno == EINTR) continue;
+                if (read_count <= 0) {
+                    printf("verify read error %s at %ld: %s\n",
+                           pw->partition, (long)p, strerror(errno));
+                    result = -1;
                     break;
                 }
-
-                sleep(2);
+                SHA_update(&ctx, buffer, read_count);
+                p += read_count;
             }
-
-            if (!success) {
-                printf("failed to verify after all attempts\n");
-                return -1;
+            if (result == 0 &&
+                memcmp(SHA_final(&ctx), sha1, SHA_DIGEST_SIZE) != 0) {
+                printf("verification of %s failed\n", pw->partition);
+                result = -1;
+            }
+            if (result == 0) {
+                printf("verification read succeeded\n");
             }
 
-            if (close(fd) != 0) {
-                printf("error closing %s (%s)\n", partition, strerror(errno));
-                return -1;
+            if (close(pw->fd) != 0) {
+                printf("error closing %s (%s)\n", pw->partition, strerror(errno));
+                result = -1;
+            }
+            if (result == 0) {
+                // hack: sync and sleep after closing in hopes of getting
+                // the data actually onto flash.
+                printf("sleeping after close\n");
+                sync();
+                sleep(5);
             }
-            // hack: sync and sleep after closing in hopes of getting
-            // the data actually onto flash.
-            printf("sleeping after close\n");
-            sync();
-            sleep(5);
             break;
         }
     }
 
-    free(copy);
-    return 0;
+    free(pw->copy);
+    return result;
 }
 
 
@@ -586,12 +687,13 @@ int applypatch_check(const char* filename,
                      int num_patches, char** const patch_sha1_str) {
     FileContents file;
     file.data = NULL;
+    file.map_length = 0;
 
     // It's okay to specify no sha1s; the check will pass if the
     // LoadFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    int filestate = LoadFileContents(filename, &file, RETOUCH_DO_MASK);
+    int filestate = LoadContents(filename, &file, RETOUCH_DO_MASK, 1);
     if (filestate == -ENOENT) {
         return -ENOENT;
     }
@@ -602,8 +704,7 @@ int applypatch_check(const char* filename,
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
-        file.data = NULL;
+        FreeFileContents(&file);
 
         // If the source file is missing or corrupted, it might be because
         // we were killed in the middle of patching it.  A copy of it
@@ -618,12 +719,12 @@ int applypatch_check(const char* filename,
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
@@ -647,22 +748,6 @@ ssize_t FileSink(unsigned char* data, ssize_t len, void* token) {
     return done;
 }
 
-typedef struct {
-    unsigned char* buffer;
-    ssize_t size;
-    ssize_t pos;
-} MemorySinkInfo;
-
-ssize_t MemorySink(unsigned char* data, ssize_t len, void* token) {
-    MemorySinkInfo* msi = (MemorySinkInfo*)token;
-    if (msi->size - msi->pos < len) {
-        return -1;
-    }
-    memcpy(msi->buffer + msi->pos, data, len);
-    msi->pos += len;
-    return len;
-}
-
 // Return the amount of free space (in bytes) on the filesystem
 // containing filename.  filename must exist.  Return -1 on error.
 size_t FreeSpaceForFile(const char* filename) {
@@ -734,19 +819,21 @@ int applypatch(const char* source_filename,
     FileContents copy_file;
     FileContents source_file;
     copy_file.data = NULL;
+    copy_file.map_length = 0;
     source_file.data = NULL;
+    source_file.map_length = 0;
     const Value* source_patch_value = NULL;
     const Value* copy_patch_value = NULL;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file,
-                         RETOUCH_DO_MASK) == 0) {
+    if (LoadContents(target_filename, &source_file,
+                     RETOUCH_DO_MASK, 1) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("\"%s\" is already target; no patch needed\n",
                    target_filename);
-            free(source_file.data);
+            FreeFileContents(&source_file);
             return 0;
         }
     }
@@ -756,10 +843,9 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
-        source_file.data = NULL;
-        LoadFileContents(source_filename, &source_file,
-                         RETOUCH_DO_MASK);
+        FreeFileContents(&source_file);
+        LoadContents(source_filename, &source_file,
+                     RETOUCH_DO_MASK, 1);
     }
 
     if (source_file.data != NULL) {
@@ -771,8 +857,7 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
-        source_file.data = NULL;
+        FreeFileContents(&source_file);
         printf("source file is bad; trying copy\n");
 
         if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file,
@@ -791,7 +876,7 @@ int applypatch(const char* source_filename,
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
-            free(copy_file.data);
+            FreeFileContents(&copy_file);
             return 1;
         }
     }
@@ -800,12 +885,42 @@ int applypatch(const char* source_filename,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
                                 target_sha1, target_size, bonus_data);
-    free(source_file.data);
-    free(copy_file.data);
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
 
     return result;
 }
 
+// Replace the (mapped) data of 'file' with a read-only mapping of the
+// copy just saved in CACHE_TEMP_SOURCE, after checking that the copy
+// has the same SHA-1.  Return 0 on success.
+static int MapSavedCopy(FileContents* file) {
+    int fd = open(CACHE_TEMP_SOURCE, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open %s: %s\n", CACHE_TEMP_SOURCE, strerror(errno));
+        return -1;
+    }
+    size_t length = 0;
+    unsigned char* data = MapReadOnly(fd, file->size, &length);
+    close(fd);
+    if (data == NULL) {
+        return -1;
+    }
+
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    if (length != (size_t)file->size ||
+        memcmp(SHA_hash(data, length, sha1), file->sha1, SHA_DIGEST_SIZE) != 0) {
+        printf("%s doesn't match the source\n", CACHE_TEMP_SOURCE);
+        munmap(data, length);
+        return -1;
+    }
+
+    FreeFileContents(file);
+    file->data = data;
+    file->map_length = length;
+    return 0;
+}
+
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
                           FileContents* copy_file,
@@ -818,7 +933,7 @@ static int GenerateTarget(FileContents* source_file,
     int retry = 1;
     SHA_CTX ctx;
     int output;
-    MemorySinkInfo msi;
+    PartitionWriter pw;
     FileContents* source_to_use;
     char* outname;
     int made_copy = 0;
@@ -842,24 +957,35 @@ static int GenerateTarget(FileContents* source_file,
 
         if (strncmp(target_filename, "MTD:", 4) == 0 ||
             strncmp(target_filename, "EMMC:", 5) == 0) {
-            // If the target is a partition, we're actually going to
-            // write the output to /tmp and then copy it to the
-            // partition.  statfs() always returns 0 blocks free for
-            // /tmp, so instead we'll just assume that /tmp has enough
-            // space to hold the file.
-
-            // We still write the original source to cache, in case
-            // the partition write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file->size) < 0) {
-                printf("not enough free space on /cache\n");
-                return 1;
-            }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                printf("failed to back up source file\n");
-                return 1;
+            // If the target is a partition, the output is written
+            // straight to it as it is produced.  Save the original
+            // source to cache first: once the write starts, the
+            // partition holds neither the source nor the target until
+            // it finishes, and if it's interrupted the next run patches
+            // from the copy.  A failed write (e.g. a verify mismatch)
+            // is retried by patching again from the source in memory.
+            // If we're already patching from the copy, it stays put.
+            if (!made_copy) {
+                if (source_patch_value != NULL) {
+                    if (MakeFreeSpaceOnCache(source_file->size) < 0) {
+                        printf("not enough free space on /cache\n");
+                        return 1;
+                    }
+                    if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                        printf("failed to back up source file\n");
+                        return 1;
+                    }
+                    // A mapped source may be the very partition we're
+                    // about to overwrite; patch from the copy instead.
+                    if (source_file->map_length != 0 &&
+                        MapSavedCopy(source_file) != 0) {
+                        printf("failed to map backup of source file\n");
+                        return 1;
+                    }
+                }
+                made_copy = 1;
+                retry = 2;
             }
-            made_copy = 1;
-            retry = 0;
         } else {
             int enough_space = 0;
             if (retry > 0) {
@@ -921,23 +1047,27 @@ static int GenerateTarget(FileContents* source_file,
             return 1;
         }
 
+        // Check the format before touching the target; a partition
+        // target is overwritten as soon as output starts.
+        if (patch->size < 8 ||
+            (memcmp(patch->data, "BSDIFF40", 8) != 0 &&
+             memcmp(patch->data, "IMGDIFF2", 8) != 0)) {
+            printf("Unknown patch file format\n");
+            return 1;
+        }
+
         SinkFn sink = NULL;
         void* token = NULL;
         output = -1;
         outname = NULL;
         if (strncmp(target_filename, "MTD:", 4) == 0 ||
             strncmp(target_filename, "EMMC:", 5) == 0) {
-            // We store the decoded output in memory.
-            msi.buffer = malloc(target_size);
-            if (msi.buffer == NULL) {
-                printf("failed to alloc %ld bytes for output\n",
-                       (long)target_size);
+            // We write the decoded output to the partition.
+            if (OpenPartitionWriter(target_filename, target_size, &pw) != 0) {
                 return 1;
             }
-            msi.pos = 0;
-            msi.size = target_size;
-            sink = MemorySink;
-            token = &msi;
+            sink = PartitionSink;
+            token = &pw;
         } else {
             // We write the decoded output to "<tgt-file>.patch".
             outname = (char*)malloc(strlen(target_filename) + 10);
@@ -977,6 +1107,12 @@ static int GenerateTarget(FileContents* source_file,
         if (output >= 0) {
             fsync(output);
             close(output);
+        } else {
+            if (ClosePartitionWriter(&pw, result == 0 ? target_sha1 : NULL) != 0 &&
+                result == 0) {
+                printf("write of patched data to %s failed\n", target_filename);
+                result = 1;
+            }
         }
 
         if (result != 0) {
@@ -1001,14 +1137,7 @@ static int GenerateTarget(FileContents* source_file,
         return 1;
     }
 
-    if (output < 0) {
-        // Copy the temp file to the partition.
-        if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
-            printf("write of patched data to %s failed\n", target_filename);
-            return 1;
-        }
-        free(msi.buffer);
-    } else {
+    if (output >= 0) {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
         if (chmod(outname, source_to_use->st.st_mode) != 0) {
@@ -32,6 +32,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  size_t map_length;  // nonzero if data is a read-only mapping
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -64,6 +65,7 @@ int applypatch_check(const char* filename,
 int LoadFileContents(const char* filename, FileContents* file,
                      int retouch_flag);
 int SaveFileContents(const char* filename, const FileContents* file);
+// Release the data of a FileContents, mapped or not.
 void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
                       int num_patches);
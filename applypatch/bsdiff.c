@@ -210,6 +210,20 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+// Build the "I" block that bsdiff() needs for 'old' (see below), for
+// callers that want it before any bsdiff() call -- e.g. so that
+// several threads can share one.
+off_t* bsdiff_index(u_char* old, off_t oldsize)
+{
+        off_t* I;
+        off_t* V;
+        I = malloc((oldsize+1) * sizeof(off_t));
+        V = malloc((oldsize+1) * sizeof(off_t));
+        qsufsort(I, V, old, oldsize);
+        free(V);
+        return I;
+}
+
 // This is main() from bsdiff.c, with the following changes:
 //
 //    - old, oldsize, new, newsize are arguments; we don't load this
@@ -241,11 +255,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	int bz2err;
 
         if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+            *IP = bsdiff_index(old, oldsize);
         }
         I = *IP;
 
@@ -122,6 +122,7 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -181,6 +182,7 @@ static int fileentry_compare(const void* a, const void* b) {
 // from bsdiff.c
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
            const char* patch_filename);
+off_t* bsdiff_index(u_char* old, off_t oldsize);
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -614,7 +616,12 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   }
 
   char ptemp[] = "/tmp/imgdiff-patch-XXXXXX";
-  mkstemp(ptemp);
+  int pfd = mkstemp(ptemp);
+  if (pfd < 0) {
+    printf("failed to create patch file: %s\n", strerror(errno));
+    return NULL;
+  }
+  close(pfd);
 
   int r = bsdiff(src->data, src->len, &(src->I), tgt->data, tgt->len, ptemp);
   if (r != 0) {
@@ -668,6 +675,119 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   return data;
 }
 
+/*
+ * The target chunks are independent, so their patches are made on
+ * several threads.  Chunks whose source is shared with other chunks
+ * (in zip mode, everything diffed against the whole source file) are
+ * queued last and wait for the main thread to build the shared
+ * sources' suffix arrays, so the lazy build in bsdiff() never races.
+ */
+typedef struct {
+  ImageChunk* tgt_chunks;
+  ImageChunk** src;             // source chunk for each target chunk
+  int* order;                   // target chunks, unshared ones first
+  int num_chunks;
+  int num_unshared;
+  unsigned char** patch_data;
+  size_t* patch_size;
+
+  int next;                     // next entry of order[] to take
+  int indexes_ready;
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+} PatchWork;
+
+static void* MakePatchWorker(void* cookie) {
+  PatchWork* work = (PatchWork*)cookie;
+  for (;;) {
+    pthread_mutex_lock(&work->lock);
+    if (work->next >= work->num_chunks) {
+      pthread_mutex_unlock(&work->lock);
+      break;
+    }
+    int n = work->next++;
+    while (n >= work->num_unshared && !work->indexes_ready) {
+      pthread_cond_wait(&work->ready, &work->lock);
+    }
+    pthread_mutex_unlock(&work->lock);
+
+    int i = work->order[n];
+    work->patch_data[i] = MakePatch(work->src[i], work->tgt_chunks+i,
+                                    work->patch_size+i);
+  }
+  return NULL;
+}
+
+/*
+ * Make the patches for all target chunks, given the source for each,
+ * filling in patch_data[] and patch_size[] by chunk index.  The result
+ * is the same whatever the number of threads.
+ */
+void MakePatches(ImageChunk* tgt_chunks, int num_chunks, ImageChunk** src,
+                 ImageChunk* src_chunks, int num_src_chunks,
+                 unsigned char** patch_data, size_t* patch_size) {
+  int i;
+  int* uses = calloc(num_src_chunks, sizeof(int));
+  for (i = 0; i < num_chunks; ++i) {
+    ++uses[src[i] - src_chunks];
+  }
+
+  PatchWork work;
+  work.tgt_chunks = tgt_chunks;
+  work.src = src;
+  work.order = malloc(num_chunks * sizeof(int));
+  work.num_chunks = num_chunks;
+  work.num_unshared = 0;
+  work.patch_data = patch_data;
+  work.patch_size = patch_size;
+  work.next = 0;
+  work.indexes_ready = 0;
+  pthread_mutex_init(&work.lock, NULL);
+  pthread_cond_init(&work.ready, NULL);
+
+  int n = 0;
+  for (i = 0; i < num_chunks; ++i) {
+    if (uses[src[i] - src_chunks] == 1) work.order[n++] = i;
+  }
+  work.num_unshared = n;
+  for (i = 0; i < num_chunks; ++i) {
+    if (uses[src[i] - src_chunks] > 1) work.order[n++] = i;
+  }
+
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_threads < 1) num_threads = 1;
+  if (num_threads > num_chunks) num_threads = num_chunks;
+  pthread_t* threads = malloc(num_threads * sizeof(pthread_t));
+  int started = 0;
+  while (started < num_threads &&
+         pthread_create(threads+started, NULL, MakePatchWorker, &work) == 0) {
+    ++started;
+  }
+
+  for (i = 0; i < num_src_chunks; ++i) {
+    if (uses[i] > 1 && src_chunks[i].I == NULL) {
+      src_chunks[i].I = bsdiff_index(src_chunks[i].data, src_chunks[i].len);
+    }
+  }
+  pthread_mutex_lock(&work.lock);
+  work.indexes_ready = 1;
+  pthread_cond_broadcast(&work.ready);
+  pthread_mutex_unlock(&work.lock);
+
+  if (started == 0) {
+    MakePatchWorker(&work);
+  }
+  for (i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+
+  pthread_cond_destroy(&work.ready);
+  pthread_mutex_destroy(&work.lock);
+  free(threads);
+  free(work.order);
+  free(uses);
+}
+
 /*
  * Cause a gzip chunk to be treated as a normal chunk (ie, as a blob
  * of uninterpreted data).  The resulting patch will likely be about
@@ -946,15 +1066,16 @@ int main(int argc, char** argv) {
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
   unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
   size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  ImageChunk** patch_src = malloc(num_tgt_chunks * sizeof(ImageChunk*));
   for (i = 0; i < num_tgt_chunks; ++i) {
     if (zip_mode) {
       ImageChunk* src;
       if (tgt_chunks[i].type == CHUNK_DEFLATE &&
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
                                  num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src;
       } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+        patch_src[i] = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -964,11 +1085,22 @@ int main(int argc, char** argv) {
         src_chunks[i].len += bonus_size;
      }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+      patch_src[i] = src_chunks+i;
+    }
+  }
+
+  MakePatches(tgt_chunks, num_tgt_chunks, patch_src,
+              src_chunks, num_src_chunks, patch_data, patch_size);
+
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    if (patch_data[i] == NULL) {
+      printf("failed to make patch for chunk %d\n", i);
+      return 1;
     }
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
   }
+  free(patch_src);
 
   // Figure out how big the imgdiff file header is going to be, so
   // that we can correctly compute the offset of each bsdiff patch
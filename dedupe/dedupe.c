@@ -64,6 +64,7 @@ typedef struct DEDUPE_STORE_CONTEXT {
 static void usage(char** argv) {
     fprintf(stderr, "usage: %s c input_directory blob_dir output_manifest [exclude...]\n", argv[0]);
     fprintf(stderr, "usage: %s x input_manifest blob_dir output_directory\n", argv[0]);
+    fprintf(stderr, "usage: %s xd input_manifest blob_dir output_directory [exclude...]\n", argv[0]);
     fprintf(stderr, "usage: %s gc blob_dir input_manifests...\n", argv[0]);
 }
 
@@ -342,6 +343,97 @@ static int check_file(const char* f) {
     return lstat(f, &cst);
 }
 
+static int remove_path(const char* path) {
+    struct stat cst;
+    if (lstat(path, &cst))
+        return errno == ENOENT ? 0 : 1;
+    if (!S_ISDIR(cst.st_mode))
+        return unlink(path);
+
+    DIR *dp = opendir(path);
+    if (dp == NULL) {
+        fprintf(stderr, "Error opening directory: %s\n", path);
+        return 1;
+    }
+    struct dirent *ep;
+    char child[PATH_MAX];
+    int ret = 0;
+    while ((ep = readdir(dp))) {
+        if (strcmp(ep->d_name, ".") == 0)
+            continue;
+        if (strcmp(ep->d_name, "..") == 0)
+            continue;
+        sprintf(child, "%s/%s", path, ep->d_name);
+        ret |= remove_path(child);
+    }
+    closedir(dp);
+    return ret | rmdir(path);
+}
+
+static int is_excluded(const char** excludes, int exclude_count, const char* path) {
+    int i;
+    for (i = 0; i < exclude_count; i++) {
+        if (!strcmp(excludes[i], path))
+            return 1;
+    }
+    return 0;
+}
+
+// remove everything under d that is not listed in the sorted manifest paths
+static void remove_extraneous(const char* d, struct array *manifest_paths, const char** excludes, int exclude_count) {
+    DIR *dp = opendir(d);
+    if (dp == NULL) {
+        fprintf(stderr, "Error opening directory: %s\n", d);
+        return;
+    }
+    struct dirent *ep;
+    char full_path[PATH_MAX];
+    while ((ep = readdir(dp))) {
+        if (strcmp(ep->d_name, ".") == 0)
+            continue;
+        if (strcmp(ep->d_name, "..") == 0)
+            continue;
+        sprintf(full_path, "%s/%s", d, ep->d_name);
+        if (is_excluded(excludes, exclude_count, full_path))
+            continue;
+
+        char *key = full_path;
+        if (bsearch(&key, manifest_paths->data, manifest_paths->size, sizeof(void*), string_compare) == NULL) {
+            printf("Delete: %s\n", full_path);
+            if (remove_path(full_path))
+                fprintf(stderr, "Error removing: %s\n", full_path);
+            continue;
+        }
+
+        struct stat cst;
+        if (lstat(full_path, &cst) == 0 && S_ISDIR(cst.st_mode))
+            remove_extraneous(full_path, manifest_paths, excludes, exclude_count);
+    }
+    closedir(dp);
+}
+
+// an existing file can be kept if it has the size recorded in the manifest
+// and either the same mtime or the same content hash as the blob
+static int is_file_unchanged(const char* filename, const char* key, int size, time_t mtime) {
+    struct stat cst;
+    if (lstat(filename, &cst) || !S_ISREG(cst.st_mode) || cst.st_size != size)
+        return 0;
+    if (mtime != 0 && cst.st_mtime == mtime)
+        return 1;
+
+    unsigned char sumdata[SHA256_DIGEST_LENGTH];
+    if (do_sha256sum_file(filename, sumdata))
+        return 0;
+    char psum[SHA256_DIGEST_LENGTH * 2 + 1];
+    int j;
+    for (j = 0; j < SHA256_DIGEST_LENGTH; j++)
+        sprintf(&psum[(j*2)], "%02x", (int)sumdata[j]);
+
+    // keys are stored as abc/defg..., see store_file()
+    return strlen(key) == SHA256_DIGEST_LENGTH * 2 + 1 &&
+            strncmp(key, psum, 3) == 0 && strcmp(key + 4, psum + 3) == 0;
+}
+
 int dedupe_main(int argc, char** argv) {
     if (argc < 3) {
         usage(argv);
@@ -381,8 +473,12 @@ int dedupe_main(int argc, char** argv) {
 
         return store_dir(&context, st, ".");
     }
-    else if (strcmp(argv[1], "x") == 0) {
-        if (argc != 5) {
+    else if (strcmp(argv[1], "x") == 0 || strcmp(argv[1], "xd") == 0) {
+        // xd is a differential extract: it keeps unchanged files in place,
+        // only writes the ones that differ and deletes what the manifest
+        // does not list, so the output directory does not need a format.
+        int differential = strcmp(argv[1], "xd") == 0;
+        if ((!differential && argc != 5) || (differential && argc < 5)) {
             usage(argv);
             return 1;
         }
@@ -414,6 +510,26 @@ int dedupe_main(int argc, char** argv) {
             fprintf(stderr, "Attempting to restore newer dedupe file: %s\n", argv[2]);
             return 1;
         }
+
+        if (differential) {
+            struct array manifest_paths;
+            array_init(&manifest_paths, ARRAY_CAPACITY);
+            long entries_offset = ftell(input_manifest);
+            while (fgets(line, PATH_MAX, input_manifest)) {
+                char field[PATH_MAX];
+                char *token = line;
+                int fields = version >= 2 ? 8 : 5;
+                while (fields-- > 0 && token != NULL)
+                    token = tokenize(field, token, '\t');
+                if (token != NULL)
+                    array_add(&manifest_paths, strdup(field));
+            }
+            qsort(manifest_paths.data, manifest_paths.size, sizeof(void*), string_compare);
+            remove_extraneous(".", &manifest_paths, (const char**)argv + 5, argc - 5);
+            array_free(&manifest_paths, 1);
+            fseek(input_manifest, entries_offset, SEEK_SET);
+        }
+
         while (fgets(line, PATH_MAX, input_manifest)) {
             //printf("%s", line);
 
@@ -454,7 +570,10 @@ int dedupe_main(int argc, char** argv) {
 
                 char blob_file[PATH_MAX];
                 sprintf(blob_file, "%s/%s", blob_dir, sha256);
-                if (ret = copy_file(blob_file, filename)) {
+                if (differential && is_file_unchanged(filename, sha256, size, version >= 2 ? atol(mt) : 0)) {
+                    // keep the existing copy, only refresh its metadata below
+                }
+                else if ((differential && (ret = remove_path(filename))) || (ret = copy_file(blob_file, filename))) {
                     fprintf(stderr, "Unable to copy file %s\n", filename);
                     fclose(input_manifest);
                     return ret;
@@ -468,6 +587,14 @@ int dedupe_main(int argc, char** argv) {
                 token = tokenize(link, token, '\t');
                 // printf("%s\n", link);
 
+                if (differential) {
+                    char existing[PATH_MAX];
+                    int len = readlink(filename, existing, PATH_MAX - 1);
+                    if (len >= 0)
+                        existing[len] = '\0';
+                    if (len < 0 || strcmp(existing, link) != 0)
+                        remove_path(filename);
+                }
                 symlink(link, filename);
 
                 // Android has no lchmod, and chmod follows symlinks
@@ -477,6 +604,11 @@ int dedupe_main(int argc, char** argv) {
             else if (strcmp(type, "d") == 0) {
                 // printf("\n");
 
+                if (differential) {
+                    struct stat cst;
+                    if (lstat(filename, &cst) == 0 && !S_ISDIR(cst.st_mode))
+                        remove_path(filename);
+                }
                 mkdir(filename, mode_oct);
 
                 chown(filename, uid_int, gid_int);
@@ -497,6 +497,10 @@ static int control_usb_storage(bool on) {
 }
 
 void show_mount_usb_storage_menu() {
+    // The host can rewrite anything it's given; don't let a package
+    // verified earlier skip verification afterwards.
+    forget_verified_packages();
+
     // Enable USB storage using vold
     if (!control_usb_storage(true))
         return;
@@ -1102,6 +1106,76 @@ static void choose_default_backup_format() {
     }
 }
 
+static void choose_nandroid_io_throttling() {
+    static const char* headers[] = { "Backup and Restore I/O Throttling",
+                                     "Applies to backup, restore and",
+                                     "freeing unused backup data.",
+                                     "",
+                                     NULL };
+    static const char* priority_names[] = { "normal", "low", "idle" };
+    static const int bandwidth_values[] = { 0, 5, 10, 20, 40 };
+    static const int nice_values[] = { 0, 5, 10, 19 };
+
+    char priority_item[100];
+    char bandwidth_item[100];
+    char nice_item[100];
+    char* list[] = { priority_item, bandwidth_item, nice_item, NULL };
+    char path[PATH_MAX];
+    char value[16];
+    int i;
+
+    for (;;) {
+        unsigned prio = nandroid_get_io_priority();
+        int bandwidth = nandroid_get_io_bandwidth();
+        int nice_value = nandroid_get_cpu_nice();
+
+        sprintf(priority_item, "I/O priority: %s", priority_names[prio]);
+        if (bandwidth > 0)
+            sprintf(bandwidth_item, "bandwidth cap: %d MB/s", bandwidth);
+        else
+            sprintf(bandwidth_item, "bandwidth cap: unlimited");
+        sprintf(nice_item, "CPU nice: %d", nice_value);
+
+        int chosen_item = get_menu_selection(headers, list, 0, 0);
+        switch (chosen_item) {
+            case 0: {
+                prio = (prio + 1) % (sizeof(priority_names) / sizeof(char*));
+                sprintf(path, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_IO_PRIORITY_FILE);
+                write_string_to_file(path, priority_names[prio]);
+                ui_print("Backup I/O priority set to %s.\n", priority_names[prio]);
+                break;
+            }
+            case 1: {
+                int count = sizeof(bandwidth_values) / sizeof(int);
+                for (i = 0; i < count && bandwidth_values[i] <= bandwidth; i++)
+                    ;
+                bandwidth = bandwidth_values[i % count];
+                sprintf(path, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_IO_BANDWIDTH_FILE);
+                sprintf(value, "%d", bandwidth);
+                write_string_to_file(path, value);
+                if (bandwidth > 0)
+                    ui_print("Backup bandwidth capped to %d MB/s.\n", bandwidth);
+                else
+                    ui_print("Backup bandwidth cap disabled.\n");
+                break;
+            }
+            case 2: {
+                int count = sizeof(nice_values) / sizeof(int);
+                for (i = 0; i < count && nice_values[i] <= nice_value; i++)
+                    ;
+                nice_value = nice_values[i % count];
+                sprintf(path, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_CPU_NICE_FILE);
+                sprintf(value, "%d", nice_value);
+                write_string_to_file(path, value);
+                ui_print("Backup CPU nice set to %d.\n", nice_value);
+                break;
+            }
+            default:
+                return;
+        }
+    }
+}
+
 static void add_nandroid_options_for_volume(char** menu, char* path, int offset) {
     char buf[100];
 
@@ -1122,7 +1196,7 @@ static void add_nandroid_options_for_volume(char** menu, char* path, int offset)
 // these go on top of menu list
 #define NANDROID_ACTIONS_NUM 4
 // number of fixed bottom entries after volume actions
-#define NANDROID_FIXED_ENTRIES 2
+#define NANDROID_FIXED_ENTRIES 4
 
 int show_nandroid_menu() {
     char* primary_path = get_primary_storage_path();
@@ -1152,6 +1226,8 @@ int show_nandroid_menu() {
     // fixed bottom entries
     list[offset] = "free unused backup data";
     list[offset + 1] = "choose default backup format";
+    list[offset + 2] = "configure I/O throttling";
+    list[offset + 3] = "toggle differential restore";
     offset += NANDROID_FIXED_ENTRIES;
 
 #ifdef RECOVERY_EXTEND_NANDROID_MENU
@@ -1173,6 +1249,14 @@ int show_nandroid_menu() {
             run_dedupe_gc();
         } else if (chosen_item == (action_entries_num + 1)) {
             choose_default_backup_format();
+        } else if (chosen_item == (action_entries_num + 2)) {
+            choose_nandroid_io_throttling();
+        } else if (chosen_item == (action_entries_num + 3)) {
+            char path[PATH_MAX];
+            int enabled = !nandroid_get_differential_restore();
+            sprintf(path, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), NANDROID_DIFFERENTIAL_RESTORE_FILE);
+            write_string_to_file(path, enabled ? "1" : "0");
+            ui_print("Differential Restore: %s\n", enabled ? "Enabled" : "Disabled");
         } else if (chosen_item < action_entries_num) {
             // get nandroid volume actions path
             if (chosen_item < NANDROID_ACTIONS_NUM) {
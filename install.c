@@ -18,8 +18,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "common.h"
@@ -42,6 +46,7 @@
 #define ASSUMED_UPDATE_BINARY_NAME  "META-INF/com/google/android/update-binary"
 #define ASSUMED_UPDATE_SCRIPT_NAME  "META-INF/com/google/android/update-script"
 #define PUBLIC_KEYS_FILE "/res/keys"
+#define PUBLIC_KEY_STORE_FILE "/res/keys.bin"
 
 // The update binary ask us to install a firmware file on reboot.  Set
 // that up.  Takes ownership of type and filename.
@@ -106,9 +111,221 @@ handle_firmware_update(char* type, char* filename, ZipArchive* zip) {
 
 static const char *LAST_INSTALL_FILE = "/cache/recovery/last_install";
 
+// Packages that passed signature verification are remembered here so
+// that retrying an install which failed for some other reason (a mount,
+// say) doesn't hash a multi-GB zip all over again.
+//
+// An entry is keyed by (device, inode, size, mtime, ctime).  None of
+// that is proof the bytes are unchanged: anything with raw access to
+// the storage can rewrite a file and set its timestamps back, and the
+// signature check on a hit only covers the stored digest, not the file.
+// So entries are only made and used for packages on internal storage
+// (/cache and /data), which recovery never exports, and they are
+// further limited to:
+//  - this boot (boot_id matches);
+//  - files whose ctime was older than the start of the verification
+//    that produced the entry, so a write racing with it (which would
+//    land in the same second) isn't missed.
+// The whole list is also dropped whenever a volume is shared over USB
+// (see forget_verified_packages()).  Anything else is a miss and the
+// package is verified in full.
+static const char *VERIFIED_CACHE_FILE = "/cache/recovery/verified_packages";
+static const char *BOOT_ID_FILE = "/proc/sys/kernel/random/boot_id";
+#define VERIFIED_CACHE_ENTRIES 8
+
+typedef struct {
+    char boot_id[40];
+    unsigned long long dev;
+    unsigned long long ino;
+    long long size;
+    long long mtime;
+    long long ctime;
+    VerifierDigest digest;
+} VerifiedEntry;
+
+static int
+read_boot_id(char* boot_id, size_t len) {
+    FILE* f = fopen(BOOT_ID_FILE, "r");
+    if (f == NULL)
+        return -1;
+    char* p = fgets(boot_id, len, f);
+    fclose(f);
+    if (p == NULL)
+        return -1;
+    boot_id[strcspn(boot_id, "\n")] = '\0';
+    return boot_id[0] != '\0' ? 0 : -1;
+}
+
+static int
+make_verified_entry(const struct stat* st, VerifiedEntry* e) {
+    memset(e, 0, sizeof(*e));
+    if (read_boot_id(e->boot_id, sizeof(e->boot_id)) != 0)
+        return -1;
+    e->dev = st->st_dev;
+    e->ino = st->st_ino;
+    e->size = st->st_size;
+    e->mtime = st->st_mtime;
+    e->ctime = st->st_ctime;
+    return 0;
+}
+
+static int
+same_verified_file(const VerifiedEntry* a, const VerifiedEntry* b) {
+    return strcmp(a->boot_id, b->boot_id) == 0 &&
+           a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+           a->mtime == b->mtime && a->ctime == b->ctime;
+}
+
+static void
+hex_encode(char* out, const uint8_t* data, size_t len) {
+    size_t i;
+    for (i = 0; i < len; ++i)
+        sprintf(out + i * 2, "%02x", data[i]);
+}
+
+static int
+hex_decode(uint8_t* out, const char* hex, size_t len) {
+    size_t i;
+    if (strlen(hex) != len * 2)
+        return -1;
+    for (i = 0; i < len; ++i) {
+        unsigned int b;
+        if (sscanf(hex + i * 2, "%2x", &b) != 1)
+            return -1;
+        out[i] = b;
+    }
+    return 0;
+}
+
+static int
+parse_verified_entry(const char* line, VerifiedEntry* e) {
+    char sha1[SHA_DIGEST_SIZE * 2 + 1];
+    char sha256[SHA256_DIGEST_SIZE * 2 + 1];
+    unsigned long signed_len;
+
+    memset(e, 0, sizeof(*e));
+    if (sscanf(line, "%39s %llu %llu %lld %lld %lld %lu %40s %64s",
+               e->boot_id, &e->dev, &e->ino, &e->size, &e->mtime, &e->ctime,
+               &signed_len, sha1, sha256) != 9)
+        return -1;
+    e->digest.signed_len = signed_len;
+    if (hex_decode(e->digest.sha1, sha1, SHA_DIGEST_SIZE) != 0 ||
+        hex_decode(e->digest.sha256, sha256, SHA256_DIGEST_SIZE) != 0)
+        return -1;
+    return 0;
+}
+
+static void
+write_verified_entry(FILE* f, const VerifiedEntry* e) {
+    char sha1[SHA_DIGEST_SIZE * 2 + 1];
+    char sha256[SHA256_DIGEST_SIZE * 2 + 1];
+    hex_encode(sha1, e->digest.sha1, SHA_DIGEST_SIZE);
+    hex_encode(sha256, e->digest.sha256, SHA256_DIGEST_SIZE);
+    fprintf(f, "%s %llu %llu %lld %lld %lld %lu %s %s\n",
+            e->boot_id, e->dev, e->ino, e->size, e->mtime, e->ctime,
+            (unsigned long)e->digest.signed_len, sha1, sha256);
+}
+
+// Read the entries from this boot into entries[]; returns how many.
+static int
+load_verified_cache(const char* boot_id, VerifiedEntry* entries, int max) {
+    FILE* f = fopen(VERIFIED_CACHE_FILE, "r");
+    if (f == NULL)
+        return 0;
+    int count = 0;
+    char line[512];
+    while (fgets(line, sizeof(line), f) != NULL) {
+        VerifiedEntry e;
+        if (parse_verified_entry(line, &e) != 0 ||
+            strcmp(e.boot_id, boot_id) != 0)
+            continue;
+        if (count == max) {
+            memmove(entries, entries + 1, (max - 1) * sizeof(*entries));
+            --count;
+        }
+        entries[count++] = e;
+    }
+    fclose(f);
+    return count;
+}
+
+// Whether 'path' is on storage that only recovery writes to while it
+// runs: /cache or /data (including emulated /sdcard on /data/media),
+// never a removable or vold-managed volume.
+static int
+verified_cache_allowed(const char* path) {
+    if (is_data_media_volume_path(path))
+        return 1;
+    Volume* v = volume_for_path(path);
+    if (v == NULL || fs_mgr_is_voldmanaged(v))
+        return 0;
+    return strcmp(v->mount_point, "/cache") == 0 ||
+           strcmp(v->mount_point, "/data") == 0;
+}
+
+void
+forget_verified_packages() {
+    if (ensure_path_mounted(VERIFIED_CACHE_FILE) != 0)
+        return;
+    if (unlink(VERIFIED_CACHE_FILE) != 0 && errno != ENOENT)
+        LOGW("failed to remove %s: %s\n", VERIFIED_CACHE_FILE, strerror(errno));
+}
+
+static int
+lookup_verified(const char* path, const struct stat* st,
+                VerifierDigest* digest) {
+    VerifiedEntry key;
+    VerifiedEntry entries[VERIFIED_CACHE_ENTRIES];
+    if (!verified_cache_allowed(path) ||
+        ensure_path_mounted(VERIFIED_CACHE_FILE) != 0 ||
+        make_verified_entry(st, &key) != 0)
+        return -1;
+    int count = load_verified_cache(key.boot_id, entries, VERIFIED_CACHE_ENTRIES);
+    int i;
+    for (i = 0; i < count; ++i) {
+        if (same_verified_file(&key, &entries[i])) {
+            *digest = entries[i].digest;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void
+remember_verified(const char* path, const struct stat* st,
+                  time_t verify_start, const VerifierDigest* digest) {
+    VerifiedEntry key;
+    VerifiedEntry entries[VERIFIED_CACHE_ENTRIES];
+
+    if (!verified_cache_allowed(path))
+        return;
+
+    // modified in the same second we started hashing; it may have
+    // changed under us without the timestamps showing it.
+    if (st->st_ctime >= verify_start || st->st_mtime >= verify_start)
+        return;
+    if (make_verified_entry(st, &key) != 0)
+        return;
+    key.digest = *digest;
+
+    int count = load_verified_cache(key.boot_id, entries, VERIFIED_CACHE_ENTRIES);
+    FILE* f = fopen_path(VERIFIED_CACHE_FILE, "w");
+    if (f == NULL) {
+        LOGW("failed to write %s: %s\n", VERIFIED_CACHE_FILE, strerror(errno));
+        return;
+    }
+    int i = count == VERIFIED_CACHE_ENTRIES ? 1 : 0;
+    for (; i < count; ++i) {
+        if (!same_verified_file(&key, &entries[i]))
+            write_verified_entry(f, &entries[i]);
+    }
+    write_verified_entry(f, &key);
+    fclose(f);
+}
+
 // If the package contains an update binary, extract it and run it.
 static int
-try_update_binary(const char *path, ZipArchive *zip) {
+try_update_binary(const char *path, ZipArchive *zip, VerifierHashTree *tree) {
 #ifdef BOARD_NATIVE_DUALBOOT_SINGLEDATA
 	int rc;
 	if((rc=device_truedualboot_before_update(path, zip))!=0)
@@ -215,6 +432,14 @@ try_update_binary(const char *path, ZipArchive *zip) {
         fclose(fallbackupdater);
     }
 
+    // The update binary opens the package on its own, so everything in
+    // it must be verified before it runs.
+    if (tree != NULL && verifier_hash_tree_finish(tree) != VERIFY_SUCCESS) {
+        LOGE("signature verification failed\n");
+        mzCloseZipArchive(zip);
+        return INSTALL_CORRUPT;
+    }
+
     int pipefd[2];
     pipe(pipefd);
 
@@ -335,7 +560,7 @@ try_update_binary(const char *path, ZipArchive *zip) {
 }
 
 static int
-really_install_package(const char *path)
+really_install_package(const char *path, const VerifierDigest* digest)
 {
     ui_set_background(BACKGROUND_ICON_INSTALLING);
     ui_print("Finding update package...\n");
@@ -370,16 +595,42 @@ really_install_package(const char *path)
 
     ui_print("Opening update package...\n");
 
+    // Map the package once: the signature check and the zip parser
+    // both work on this mapping, so it is only read from storage once.
+    // The file is stat'ed through the same descriptor that is mapped, so
+    // a verified-cache hit is known to describe the bytes we'll use.
+    MemMapping map;
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Unable to open '%s': %s\n", path, strerror(errno));
+        return INSTALL_CORRUPT;
+    }
+    if (fstat(fd, &st) != 0 || sysMapFileInShmem(fd, &map) != 0) {
+        close(fd);
+        LOGE("failed to map file\n");
+        return INSTALL_CORRUPT;
+    }
+    close(fd);
+
     int err;
+    VerifierHashTree tree;
+    bool use_tree = false;
 
     if (signature_check_enabled) {
         int numKeys;
-        Certificate* loadedKeys = load_keys(PUBLIC_KEYS_FILE, &numKeys);
+        const char* keysFile = PUBLIC_KEY_STORE_FILE;
+        Certificate* loadedKeys = load_key_store(keysFile, &numKeys);
+        if (loadedKeys == NULL) {
+            keysFile = PUBLIC_KEYS_FILE;
+            loadedKeys = load_keys(keysFile, &numKeys);
+        }
         if (loadedKeys == NULL) {
             LOGE("Failed to load keys\n");
+            sysReleaseShmem(&map);
             return INSTALL_CORRUPT;
         }
-        LOGI("%d key(s) loaded from %s\n", numKeys, PUBLIC_KEYS_FILE);
+        LOGI("%d key(s) loaded from %s\n", numKeys, keysFile);
 
         // Give verification half the progress bar...
         ui_print("Verifying update package...\n");
@@ -387,34 +638,90 @@ really_install_package(const char *path)
                 VERIFICATION_PROGRESS_FRACTION,
                 VERIFICATION_PROGRESS_TIME);
 
-        err = verify_file(path, loadedKeys, numKeys);
+        VerifierDigest cached;
+        if (digest != NULL) {
+            // hashed already, while the package was being copied
+            err = verify_file_digest(map.addr, map.length, digest,
+                                     loadedKeys, numKeys);
+        } else if (lookup_verified(path, &st, &cached) == 0 &&
+                   verify_file_digest(map.addr, map.length, &cached,
+                                      loadedKeys, numKeys) == VERIFY_SUCCESS) {
+            LOGI("%s verified earlier this boot; not hashing it again\n", path);
+            err = VERIFY_SUCCESS;
+        } else if (verifier_open_hash_tree(map.addr, map.length, loadedKeys,
+                                           numKeys, &tree) == VERIFY_SUCCESS) {
+            // chunks are checked as they are read, and the rest in the
+            // background; try_update_binary() waits for all of them
+            // before it runs anything from the package.
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            verifier_hash_tree_start(&tree, cpus > 0 ? (int)cpus : 1);
+            use_tree = true;
+            err = VERIFY_SUCCESS;
+        } else {
+            // the whole package is hashed front to back
+            VerifierDigest computed;
+            time_t verify_start = time(NULL);
+            sysAdviseShmem(&map, MADV_SEQUENTIAL);
+            err = verify_file_and_digest(map.addr, map.length,
+                                         loadedKeys, numKeys, &computed);
+            sysAdviseShmem(&map, MADV_NORMAL);
+            if (err == VERIFY_SUCCESS) {
+                remember_verified(path, &st, verify_start, &computed);
+            }
+        }
         free(loadedKeys);
         LOGI("verify_file returned %d\n", err);
         if (err != VERIFY_SUCCESS) {
             LOGE("signature verification failed\n");
             ui_show_text(1);
-            if (!confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip"))
+            if (!confirm_selection("Install Untrusted Package?", "Yes - Install untrusted zip")) {
+                sysReleaseShmem(&map);
                 return INSTALL_CORRUPT;
+            }
         }
     }
 
     /* Try to open the package.
      */
     ZipArchive zip;
-    err = mzOpenZipArchive(path, &zip);
+    if (use_tree) {
+        // the tree and the archive share the mapping, so we keep it
+        err = mzOpenZipArchiveVerified(path, &map, verifier_hash_tree_check,
+                                       &tree, &zip);
+    } else {
+        err = mzOpenZipArchiveFromMap(path, &map, &zip);
+        sysReleaseShmem(&map);
+    }
     if (err != 0) {
         LOGE("Can't open %s\n(%s)\n", path, err != -1 ? strerror(err) : "bad");
+        if (use_tree) {
+            verifier_close_hash_tree(&tree);
+            sysReleaseShmem(&map);
+        }
         return INSTALL_CORRUPT;
     }
+    // update-binary opens the package again; let it reuse this parse
+    mzWriteZipIndex(&zip);
 
     /* Verify and install the contents of the package.
      */
     ui_print("Installing update...\n");
-    return try_update_binary(path, &zip);
+    int ret = try_update_binary(path, &zip, use_tree ? &tree : NULL);
+    if (use_tree) {
+        verifier_close_hash_tree(&tree);
+        sysReleaseShmem(&map);
+    }
+    return ret;
 }
 
 int
 install_package(const char* path)
+{
+    return install_package_with_digest(path, NULL);
+}
+
+int
+install_package_with_digest(const char* path, const VerifierDigest* digest)
 {
     FILE* install_log = fopen_path(LAST_INSTALL_FILE, "w");
     if (install_log) {
@@ -423,7 +730,7 @@ install_package(const char* path)
     } else {
         LOGE("failed to open last_install: %s\n", strerror(errno));
     }
-    int result = really_install_package(path);
+    int result = really_install_package(path, digest);
     if (install_log) {
         fputc(result == INSTALL_SUCCESS ? '1' : '0', install_log);
         fputc('\n', install_log);
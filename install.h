@@ -22,4 +22,15 @@
 enum { INSTALL_SUCCESS, INSTALL_ERROR, INSTALL_CORRUPT, INSTALL_UPDATE_SCRIPT_MISSING, INSTALL_UPDATE_BINARY_MISSING };
 int install_package(const char *root_path);
 
+struct VerifierDigest;
+
+// Install a package whose signed region has already been hashed (see
+// verify_file_digest()); digest may be NULL to hash it here as usual.
+int install_package_with_digest(const char *root_path,
+                                const struct VerifierDigest* digest);
+
+// Drop the list of packages known to be verified this boot, e.g. because
+// a volume is being exposed to something that could rewrite them.
+void forget_verified_packages();
+
 #endif  // RECOVERY_INSTALL_H_
@@ -377,8 +377,11 @@ static void adb_cleanup(void)
     usb_cleanup();
 }
 
-int adb_main()
+int sideload_digest_fd = -1;
+
+int adb_main(int digest_fd)
 {
+    sideload_digest_fd = digest_fd;
     atexit(adb_cleanup);
 #if defined(HAVE_FORKEXEC)
     // No SIGCHLD. Let the service subproc handle its children.
@@ -217,7 +217,11 @@ void send_packet(apacket *p, atransport *t);
 
 void get_my_path(char *s, size_t maxLen);
 int launch_server(int server_port);
-int adb_main();
+/* digest_fd, if not -1, receives the VerifierDigest of a sideloaded
+** package, computed as it arrives, so recovery needn't hash it again.
+*/
+int adb_main(int digest_fd);
+extern int sideload_digest_fd;
 
 
 /* transports are ref-counted
@@ -22,6 +22,7 @@
 
 #include "sysdeps.h"
 #include "fdevent.h"
+#include "verifier.h"
 
 #define  TRACE_TAG  TRACE_SERVICES
 #include "adb.h"
@@ -48,9 +49,17 @@ static void sideload_service(int s, void *cookie)
     unsigned char buf[4096];
     unsigned count = (unsigned) cookie;
     int fd;
+    VerifierStream *stream = NULL;
 
     fprintf(stderr, "sideload_service invoked\n");
 
+    // Digest the package while it arrives, so recovery doesn't have to
+    // read it all back just to verify it.
+    if (sideload_digest_fd >= 0) {
+        stream = malloc(sizeof(VerifierStream));
+        if (stream != NULL) verifier_stream_init(stream);
+    }
+
     fd = adb_creat(ADB_SIDELOAD_FILENAME, 0644);
     if(fd < 0) {
         fprintf(stderr, "failed to create %s\n", ADB_SIDELOAD_FILENAME);
@@ -62,9 +71,18 @@ static void sideload_service(int s, void *cookie)
         unsigned xfer = (count > 4096) ? 4096 : count;
         if(readx(s, buf, xfer)) break;
         if(writex(fd, buf, xfer)) break;
+        if(stream) verifier_stream_update(stream, buf, xfer);
         count -= xfer;
     }
 
+    if(count == 0 && stream) {
+        VerifierDigest digest;
+        if(verifier_stream_finish(stream, &digest) == VERIFY_SUCCESS) {
+            writex(sideload_digest_fd, &digest, sizeof(digest));
+        }
+    }
+    free(stream);
+
     if(count == 0) {
         writex(s, "OKAY", 4);
     } else {
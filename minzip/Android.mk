@@ -2,6 +2,7 @@ LOCAL_PATH := $(call my-dir)
 include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
+	Crc32.c \
 	Hash.c \
 	SysUtil.c \
 	DirUtil.c \
@@ -0,0 +1,291 @@
+/*
+ * Copyright 2014 The Android Open Source Project
+ *
+ * CRC-32 of zip entry data.
+ *
+ * zlib's crc32() is table driven and manages about a byte per cycle.
+ * ARMv8 has CRC32 instructions for exactly this polynomial, and x86 can
+ * fold 64 bytes at a time with carry-less multiplies (PCLMULQDQ, as in
+ * Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction").  Either is picked at runtime when the CPU has it.
+ */
+#include "Crc32.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "zlib.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+#define HAVE_PCLMUL 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(__ARM_FEATURE_CRC32) && (defined(__aarch64__) || defined(__arm__))
+#define HAVE_ARMV8_CRC 1
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#endif
+
+typedef uint32_t (*Crc32Function)(uint32_t crc, const unsigned char* data,
+        size_t len);
+
+static uint32_t crc32Zlib(uint32_t crc, const unsigned char* data, size_t len)
+{
+    /* zlib takes a uInt length */
+    while (len > 0) {
+        uInt n = len > 0x40000000 ? 0x40000000 : (uInt) len;
+        crc = crc32(crc, data, n);
+        data += n;
+        len -= n;
+    }
+    return crc;
+}
+
+#ifdef HAVE_ARMV8_CRC
+
+#ifdef __aarch64__
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+static bool cpuHasCrc32(void)
+{
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+}
+#else
+#ifndef HWCAP2_CRC32
+#define HWCAP2_CRC32 (1 << 4)
+#endif
+static bool cpuHasCrc32(void)
+{
+    return (getauxval(AT_HWCAP2) & HWCAP2_CRC32) != 0;
+}
+#endif
+
+static uint32_t crc32Armv8(uint32_t crc, const unsigned char* data,
+        size_t len)
+{
+    crc = ~crc;
+    while (len > 0 && ((uintptr_t) data & 7) != 0) {
+        crc = __crc32b(crc, *data++);
+        len--;
+    }
+#ifdef __aarch64__
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, data, sizeof(v));
+        crc = __crc32d(crc, v);
+        data += 8;
+        len -= 8;
+    }
+#endif
+    while (len >= 4) {
+        uint32_t v;
+        memcpy(&v, data, sizeof(v));
+        crc = __crc32w(crc, v);
+        data += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        crc = __crc32b(crc, *data++);
+        len--;
+    }
+    return ~crc;
+}
+
+#endif /*HAVE_ARMV8_CRC*/
+
+#ifdef HAVE_PCLMUL
+
+static bool cpuHasPclmul(void)
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+    return (ecx & bit_PCLMUL) != 0 && (ecx & bit_SSE4_1) != 0;
+}
+
+/*
+ * Fold a multiple of 16 bytes (at least 64) into the bit-reflected CRC
+ * state "crc" (i.e. already inverted), returning the new state.
+ * The constants are x^(k) mod P for the gzip polynomial, from the paper.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32FoldPclmul(uint32_t crc, const unsigned char* buf,
+        size_t len)
+{
+    static const uint64_t __attribute__((aligned(16))) k1k2[] =
+            { 0x0154442bd4ULL, 0x01c6e41596ULL };
+    static const uint64_t __attribute__((aligned(16))) k3k4[] =
+            { 0x01751997d0ULL, 0x00ccaa009eULL };
+    static const uint64_t __attribute__((aligned(16))) k5k0[] =
+            { 0x0163cd6124ULL, 0x0000000000ULL };
+    static const uint64_t __attribute__((aligned(16))) poly[] =
+            { 0x01db710641ULL, 0x01f7011641ULL };
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+    x1 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+    x0 = _mm_load_si128((const __m128i*) k1k2);
+    buf += 64;
+    len -= 64;
+
+    /* fold four lanes in parallel, 64 bytes per step */
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        y5 = _mm_loadu_si128((const __m128i*) (buf + 0x00));
+        y6 = _mm_loadu_si128((const __m128i*) (buf + 0x10));
+        y7 = _mm_loadu_si128((const __m128i*) (buf + 0x20));
+        y8 = _mm_loadu_si128((const __m128i*) (buf + 0x30));
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+        buf += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i*) k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    /* then any remaining 16-byte blocks */
+    while (len >= 16) {
+        x2 = _mm_loadu_si128((const __m128i*) buf);
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+        buf += 16;
+        len -= 16;
+    }
+
+    /* 128 bits down to 64 */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_srli_si128(x1, 8);
+    x1 = _mm_xor_si128(x1, x2);
+    x0 = _mm_loadl_epi64((const __m128i*) k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, x3);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i*) poly);
+    x2 = _mm_and_si128(x1, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+    x2 = _mm_and_si128(x2, x3);
+    x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+static uint32_t crc32Pclmul(uint32_t crc, const unsigned char* data,
+        size_t len)
+{
+    if (len >= 64) {
+        size_t chunk = len & ~(size_t) 15;
+        crc = ~crc32FoldPclmul(~crc, data, chunk);
+        data += chunk;
+        len -= chunk;
+    }
+    return crc32Zlib(crc, data, len);
+}
+
+#endif /*HAVE_PCLMUL*/
+
+typedef struct {
+    const char* name;
+    Crc32Function fn;
+} Crc32Backend;
+
+static const Crc32Backend gBackends[] = {
+#ifdef HAVE_ARMV8_CRC
+    { "armv8-crc", crc32Armv8 },
+#endif
+#ifdef HAVE_PCLMUL
+    { "pclmul", crc32Pclmul },
+#endif
+    { "zlib", crc32Zlib },
+};
+
+static const Crc32Backend* gSelected = NULL;
+
+static bool backendSupported(const Crc32Backend* backend)
+{
+#ifdef HAVE_ARMV8_CRC
+    if (backend->fn == crc32Armv8) return cpuHasCrc32();
+#endif
+#ifdef HAVE_PCLMUL
+    if (backend->fn == crc32Pclmul) return cpuHasPclmul();
+#endif
+    return true;
+}
+
+static const Crc32Backend* selectedBackend(void)
+{
+    /* Racing first calls all pick the same entry, so no lock. */
+    const Crc32Backend* backend = gSelected;
+    if (backend == NULL) {
+        size_t i;
+        for (i = 0; i < sizeof(gBackends) / sizeof(gBackends[0]); i++) {
+            if (backendSupported(&gBackends[i])) {
+                backend = &gBackends[i];
+                break;
+            }
+        }
+        gSelected = backend;
+    }
+    return backend;
+}
+
+int mzCrc32SelectBackend(const char* name)
+{
+    size_t i;
+    if (name == NULL) {
+        gSelected = NULL;
+        return 0;
+    }
+    for (i = 0; i < sizeof(gBackends) / sizeof(gBackends[0]); i++) {
+        if (strcmp(gBackends[i].name, name) == 0 &&
+                backendSupported(&gBackends[i])) {
+            gSelected = &gBackends[i];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char* mzCrc32Backend(void)
+{
+    return selectedBackend()->name;
+}
+
+unsigned long mzCrc32(unsigned long crc, const unsigned char* data,
+        size_t len)
+{
+    return selectedBackend()->fn((uint32_t) crc, data, len);
+}
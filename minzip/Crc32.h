@@ -0,0 +1,39 @@
+/*
+ * Copyright 2014 The Android Open Source Project
+ *
+ * CRC-32 of zip entry data, with hardware acceleration where available.
+ */
+#ifndef _MINZIP_CRC32
+#define _MINZIP_CRC32
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Update a running CRC-32 with "len" more bytes.  Same polynomial and
+ * conventions as zlib's crc32(): start from 0, feed the data in any
+ * number of pieces.
+ */
+unsigned long mzCrc32(unsigned long crc, const unsigned char* data,
+        size_t len);
+
+/*
+ * Name of the implementation in use: "armv8-crc", "pclmul" or "zlib".
+ */
+const char* mzCrc32Backend(void);
+
+/*
+ * Force an implementation by name, or NULL to pick the fastest one this
+ * CPU supports (the default).  Returns 0 on success, -1 if the name is
+ * unknown or not supported here.  Meant for tests and benchmarks.
+ */
+int mzCrc32SelectBackend(const char* name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*_MINZIP_CRC32*/
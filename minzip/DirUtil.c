@@ -22,6 +22,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <limits.h>
 
 #include "DirUtil.h"
@@ -52,58 +53,67 @@ getPathDirStatus(const char *path)
     return DMISSING;
 }
 
-int
-dirCreateHierarchy(const char *path, int mode,
-        const struct utimbuf *timestamp, bool stripFileName,
-        struct selabel_handle *sehnd)
+/* The directory-existence cache: a set of paths, without trailing
+ * slashes.
+ */
+static unsigned int
+hashPath(const char *path)
 {
-    DirStatus ds;
+    unsigned int hash = 2;
 
-    /* Check for an empty string before we bother
-     * making any syscalls.
-     */
-    if (path[0] == '\0') {
-        errno = ENOENT;
-        return -1;
-    }
+    while (*path != '\0')
+        hash = hash * 31 + *path++;
+    return hash;
+}
 
-    /* Allocate a path that we can modify; stick a slash on
-     * the end to make things easier.
-     */
-    size_t pathLen = strlen(path);
-    char *cpath = (char *)malloc(pathLen + 2);
-    if (cpath == NULL) {
-        errno = ENOMEM;
-        return -1;
+static int
+comparePaths(const void *tableItem, const void *looseItem)
+{
+    return strcmp((const char *)tableItem, (const char *)looseItem);
+}
+
+static bool
+dirCacheContains(DirCache *cache, const char *path)
+{
+    return cache != NULL && cache->known != NULL &&
+            mzHashTableLookup(cache->known, hashPath(path), (void *)path,
+                    comparePaths, false) != NULL;
+}
+
+static void
+dirCacheAdd(DirCache *cache, const char *path)
+{
+    if (cache == NULL || cache->known == NULL ||
+            dirCacheContains(cache, path)) {
+        return;
     }
-    memcpy(cpath, path, pathLen);
-    if (stripFileName) {
-        /* Strip everything after the last slash.
-         */
-        char *c = cpath + pathLen - 1;
-        while (c != cpath && *c != '/') {
-            c--;
-        }
-        if (c == cpath) {
-//xxx test this path
-            /* No directory component.  Act like the path was empty.
-             */
-            errno = ENOENT;
-            free(cpath);
-            return -1;
-        }
-        c[1] = '\0';    // Terminate after the slash we found.
-    } else {
-        /* Make sure that the path ends in a slash.
-         */
-        cpath[pathLen] = '/';
-        cpath[pathLen + 1] = '\0';
+    char *copy = strdup(path);
+    if (copy != NULL) {
+        mzHashTableLookup(cache->known, hashPath(copy), copy,
+                comparePaths, true);
     }
+}
+
+/* "cpath" ends in a slash, which may be overwritten temporarily.
+ */
+static int
+createHierarchy(char *cpath, int mode, const struct utimbuf *timestamp,
+        struct selabel_handle *sehnd, DirCache *cache)
+{
+    DirStatus ds;
+    size_t len = strlen(cpath);
 
     /* See if it already exists.
      */
+    cpath[len - 1] = '\0';
+    if (len > 1 && dirCacheContains(cache, cpath)) {
+        return 0;
+    }
+    cpath[len - 1] = '/';
     ds = getPathDirStatus(cpath);
     if (ds == DDIR) {
+        cpath[len - 1] = '\0';
+        dirCacheAdd(cache, cpath);
         return 0;
     } else if (ds == DILLEGAL) {
         return -1;
@@ -135,12 +145,15 @@ dirCreateHierarchy(const char *path, int mode,
         /* Check this part of the path and make a new directory
          * if necessary.
          */
+        if (dirCacheContains(cache, cpath)) {
+            *p = '/';
+            continue;
+        }
         ds = getPathDirStatus(cpath);
         if (ds == DILLEGAL) {
             /* Could happen if some other process/thread is
              * messing with the filesystem.
              */
-            free(cpath);
             return -1;
         } else if (ds == DMISSING) {
             int err;
@@ -160,25 +173,154 @@ dirCreateHierarchy(const char *path, int mode,
             }
 
             if (err != 0) {
-                free(cpath);
                 return -1;
             }
             if (timestamp != NULL && utime(cpath, timestamp)) {
-                free(cpath);
                 return -1;
             }
         }
         // else, this directory already exists.
-        
+        dirCacheAdd(cache, cpath);
+
         /* Repair the path and continue.
          */
         *p = '/';
     }
-    free(cpath);
 
     return 0;
 }
 
+static int
+cachedCreateHierarchy(const char *path, int mode,
+        const struct utimbuf *timestamp, bool stripFileName,
+        struct selabel_handle *sehnd, DirCache *cache)
+{
+    /* Check for an empty string before we bother
+     * making any syscalls.
+     */
+    if (path[0] == '\0') {
+        errno = ENOENT;
+        return -1;
+    }
+
+    /* Allocate a path that we can modify; stick a slash on
+     * the end to make things easier.
+     */
+    size_t pathLen = strlen(path);
+    char *cpath = (char *)malloc(pathLen + 2);
+    if (cpath == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(cpath, path, pathLen);
+    if (stripFileName) {
+        /* Strip everything after the last slash.
+         */
+        char *c = cpath + pathLen - 1;
+        while (c != cpath && *c != '/') {
+            c--;
+        }
+        if (c == cpath) {
+//xxx test this path
+            /* No directory component.  Act like the path was empty.
+             */
+            errno = ENOENT;
+            free(cpath);
+            return -1;
+        }
+        c[1] = '\0';    // Terminate after the slash we found.
+    } else {
+        /* Make sure that the path ends in a slash.
+         */
+        cpath[pathLen] = '/';
+        cpath[pathLen + 1] = '\0';
+    }
+
+    int ret = createHierarchy(cpath, mode, timestamp, sehnd, cache);
+    int saved = errno;
+    free(cpath);
+    errno = saved;
+    return ret;
+}
+
+int
+dirCreateHierarchy(const char *path, int mode,
+        const struct utimbuf *timestamp, bool stripFileName,
+        struct selabel_handle *sehnd)
+{
+    return cachedCreateHierarchy(path, mode, timestamp, stripFileName,
+            sehnd, NULL);
+}
+
+void
+dirCacheInit(DirCache *cache)
+{
+    cache->known = mzHashTableCreate(64, free);
+    cache->lastDir = NULL;
+    cache->lastFd = -1;
+}
+
+void
+dirCacheRelease(DirCache *cache)
+{
+    mzHashTableFree(cache->known);
+    cache->known = NULL;
+    free(cache->lastDir);
+    cache->lastDir = NULL;
+    if (cache->lastFd >= 0) {
+        close(cache->lastFd);
+        cache->lastFd = -1;
+    }
+}
+
+int
+dirCacheCreateHierarchy(DirCache *cache, const char *path, int mode,
+        const struct utimbuf *timestamp, bool stripFileName,
+        struct selabel_handle *sehnd)
+{
+    return cachedCreateHierarchy(path, mode, timestamp, stripFileName,
+            sehnd, cache);
+}
+
+int
+dirCacheOpenParent(DirCache *cache, const char *path, const char **leaf)
+{
+    const char *slash = strrchr(path, '/');
+    if (slash == NULL || slash[1] == '\0') {
+        errno = EINVAL;
+        return -1;
+    }
+    *leaf = slash + 1;
+
+    size_t dirLen = slash == path ? 1 : (size_t)(slash - path);
+    if (cache->lastDir != NULL && strlen(cache->lastDir) == dirLen &&
+            memcmp(cache->lastDir, path, dirLen) == 0) {
+        return cache->lastFd;
+    }
+
+    char *dir = (char *)malloc(dirLen + 1);
+    if (dir == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(dir, path, dirLen);
+    dir[dirLen] = '\0';
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        int saved = errno;
+        free(dir);
+        errno = saved;
+        return -1;
+    }
+    if (cache->lastFd >= 0) {
+        close(cache->lastFd);
+    }
+    free(cache->lastDir);
+    cache->lastDir = dir;
+    cache->lastFd = fd;
+    return fd;
+}
+
 int
 dirUnlinkHierarchy(const char *path)
 {
@@ -20,6 +20,8 @@
 #include <stdbool.h>
 #include <utime.h>
 
+#include "Hash.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -44,6 +46,35 @@ int dirCreateHierarchy(const char *path, int mode,
         const struct utimbuf *timestamp, bool stripFileName,
         struct selabel_handle* sehnd);
 
+/* For creating many files in a few directories, as when extracting a
+ * package: remembers which directories are known to exist, so their
+ * paths aren't walked and stat()ed again for every file, and keeps the
+ * most recently used one open for the *at() calls.
+ */
+typedef struct DirCache {
+    HashTable *known;       // paths of existing directories
+    char *lastDir;          // the directory lastFd refers to
+    int lastFd;
+} DirCache;
+
+void dirCacheInit(DirCache *cache);
+void dirCacheRelease(DirCache *cache);
+
+/* Like dirCreateHierarchy(), but skipping directories already in the
+ * cache, and adding the ones it finds or creates.  Only valid while
+ * nothing else removes directories from under the cache.
+ */
+int dirCacheCreateHierarchy(DirCache *cache, const char *path, int mode,
+        const struct utimbuf *timestamp, bool stripFileName,
+        struct selabel_handle *sehnd);
+
+/* Return an fd for the directory containing "path" and point *leaf at
+ * the last component of "path", for use with openat() and friends.  The
+ * fd belongs to the cache and stays valid until the next call.  Returns
+ * -1 (and sets errno) on failure.
+ */
+int dirCacheOpenParent(DirCache *cache, const char *path, const char **leaf);
+
 /* rm -rf <path>
  */
 int dirUnlinkHierarchy(const char *path);
@@ -7,6 +7,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <fcntl.h>
 #include <sys/mman.h>
 #include <limits.h>
 #include <errno.h>
@@ -192,6 +193,44 @@ int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     return 0;
 }
 
+/*
+ * Map a whole file, by name, into a shared, read-only memory segment.
+ *
+ * On success, returns 0 and fills out "pMap".  On failure, returns a nonzero
+ * value and does not disturb "pMap".
+ */
+int sysMapFile(const char* fn, MemMapping* pMap)
+{
+    int fd, ret;
+
+    assert(pMap != NULL);
+
+    fd = open(fn, O_RDONLY);
+    if (fd < 0) {
+        LOGE("Unable to open '%s': %s\n", fn, strerror(errno));
+        return -1;
+    }
+
+    /* the mapping keeps its own reference to the file */
+    ret = sysMapFileInShmem(fd, pMap);
+    close(fd);
+    return ret;
+}
+
+/*
+ * Give the kernel an access pattern hint for a mapping.
+ */
+void sysAdviseShmem(const MemMapping* pMap, int advice)
+{
+    if (pMap->baseAddr == NULL || pMap->baseLength == 0)
+        return;
+
+    if (madvise(pMap->baseAddr, pMap->baseLength, advice) < 0) {
+        LOGW("madvise(%p, %d, %d) failed: %s\n",
+            pMap->baseAddr, (int)pMap->baseLength, advice, strerror(errno));
+    }
+}
+
 /*
  * Release a memory mapping.
  */
@@ -51,6 +51,22 @@ int sysMapFileInShmem(int fd, MemMapping* pMap);
 int sysMapFileSegmentInShmem(int fd, off_t start, long length,
     MemMapping* pMap);
 
+/*
+ * Map a whole file, by name, into a shared, read-only memory segment.
+ * The descriptor is closed again; the mapping stays valid until it is
+ * released with sysReleaseShmem().
+ *
+ * On success, "pMap" is filled in, and zero is returned.
+ */
+int sysMapFile(const char* fn, MemMapping* pMap);
+
+/*
+ * Tell the kernel how a mapped segment is about to be accessed
+ * (MADV_SEQUENTIAL, MADV_NORMAL, ...).  This is only a hint; failures
+ * are logged and otherwise ignored.
+ */
+void sysAdviseShmem(const MemMapping* pMap, int advice);
+
 /*
  * Release the pages associated with a shared memory segment.
  *
@@ -6,17 +6,23 @@
 #include "safe_iop.h"
 #include "zlib.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <linux/falloc.h>
+#include <pthread.h>
 #include <stdint.h>     // for uintptr_t
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>   // for S_ISLNK()
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #define LOG_TAG "minzip"
 #include "Zip.h"
 #include "Bits.h"
+#include "Crc32.h"
 #include "Log.h"
 #include "DirUtil.h"
 
@@ -97,64 +103,87 @@ static void dumpEntry(const ZipEntry* pEntry)
 #endif
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * Compare two ZipEntry structs, by name.
+ * Name index.  Open addressing with linear probing over a power-of-two
+ * table kept at most half full.  Each slot holds the top 32 bits of the
+ * name's hash next to the entry's index, so a probe only touches the
+ * entry itself when the hashes match.
  */
-static int hashcmpZipEntry(const void* ventry1, const void* ventry2)
-{
-    const ZipEntry* entry1 = (const ZipEntry*) ventry1;
-    const ZipEntry* entry2 = (const ZipEntry*) ventry2;
-
-    if (entry1->fileNameLen != entry2->fileNameLen)
-        return entry1->fileNameLen - entry2->fileNameLen;
-    return memcmp(entry1->fileName, entry2->fileName, entry1->fileNameLen);
-}
+typedef struct ZipNameSlot {
+    unsigned int hash;
+    unsigned int index;         // entry index + 1; 0 means empty
+} ZipNameSlot;
 
 /*
- * (This is a mzHashTableLookup callback.)
- *
- * find a ZipEntry struct by name.
+ * Hash a file name eight bytes at a time, with a final avalanche so the
+ * low bits (the slot) and the high bits (the stored tag) are both good.
  */
-static int hashcmpZipName(const void* ventry, const void* vname)
+static uint64_t hashName(const char* name, size_t nameLen)
 {
-    const ZipEntry* entry = (const ZipEntry*) ventry;
-    const char* name = (const char*) vname;
-    unsigned int nameLen = strlen(name);
+    const uint64_t k = 0x9e3779b97f4a7c15ULL;
+    uint64_t h = nameLen * k;
+    uint64_t w;
+
+    for (; nameLen >= 8; name += 8, nameLen -= 8) {
+        memcpy(&w, name, 8);
+        h = (h ^ w) * k;
+        h ^= h >> 32;
+    }
+    for (w = 0; nameLen > 0; nameLen--) {
+        w = (w << 8) | (unsigned char) *name++;
+    }
+    h = (h ^ w) * k;
 
-    if (entry->fileNameLen != nameLen)
-        return entry->fileNameLen - nameLen;
-    return memcmp(entry->fileName, name, nameLen);
+    h ^= h >> 29;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 32;
+    return h;
 }
 
 /*
- * Compute the hash code for a ZipEntry filename.
- *
- * Not expected to be compatible with any other hash function, so we init
- * to 2 to ensure it doesn't happen to match.
+ * Index every entry by name.  Entries must already be in their final
+ * order.  Duplicate names keep the first entry, and are logged.
  */
-static unsigned int computeHash(const char* name, int nameLen)
+static bool buildNameIndex(ZipArchive* pArchive)
 {
-    unsigned int hash = 2;
-
-    while (nameLen--)
-        hash = hash * 31 + *name++;
-
-    return hash;
-}
+    unsigned int size = 16;
+    unsigned int i;
 
-static void addEntryToHashTable(HashTable* pHash, ZipEntry* pEntry)
-{
-    unsigned int itemHash = computeHash(pEntry->fileName, pEntry->fileNameLen);
-    const ZipEntry* found;
+    while (size < pArchive->numEntries * 2) {
+        size *= 2;
+    }
+    pArchive->pIndex = (ZipNameSlot*) calloc(size, sizeof(ZipNameSlot));
+    if (pArchive->pIndex == NULL) {
+        return false;
+    }
+    pArchive->indexMask = size - 1;
 
-    found = (const ZipEntry*)mzHashTableLookup(pHash,
-                itemHash, pEntry, hashcmpZipEntry, true);
-    if (found != pEntry) {
-        LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
-            found->fileNameLen, found->fileName);
-        /* keep going */
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        uint64_t h = hashName(pEntry->fileName, pEntry->fileNameLen);
+        unsigned int tag = h >> 32;
+        unsigned int slot = h & pArchive->indexMask;
+        ZipNameSlot* pSlot;
+
+        for (;; slot = (slot + 1) & pArchive->indexMask) {
+            pSlot = &pArchive->pIndex[slot];
+            if (pSlot->index == 0) {
+                pSlot->hash = tag;
+                pSlot->index = i + 1;
+                break;
+            }
+            const ZipEntry* found = &pArchive->pEntries[pSlot->index - 1];
+            if (pSlot->hash == tag &&
+                    found->fileNameLen == pEntry->fileNameLen &&
+                    memcmp(found->fileName, pEntry->fileName,
+                            pEntry->fileNameLen) == 0) {
+                LOGW("WARNING: duplicate entry '%.*s' in Zip\n",
+                    found->fileNameLen, found->fileName);
+                /* keep going */
+                break;
+            }
+        }
     }
+    return true;
 }
 
 static int validFilename(const char *fileName, unsigned int fileNameLen)
@@ -177,6 +206,112 @@ static int validFilename(const char *fileName, unsigned int fileNameLen)
     return 1;
 }
 
+/*
+ * Run the archive's verifier, if it has one, over [offset, offset+length).
+ */
+static bool verifyZipRange(const ZipArchive* pArchive, size_t offset,
+    size_t length)
+{
+    if (pArchive->verifyRange == NULL)
+        return true;
+    if (!pArchive->verifyRange(offset, length, pArchive->verifyCookie)) {
+        LOGE("Verification of %zu bytes at %zu failed\n", length, offset);
+        return false;
+    }
+    return true;
+}
+
+#if SORT_ENTRIES
+/*
+ * Order entries by name, bytewise, with a name that is a prefix of
+ * another sorting first.
+ */
+static int compareEntryNames(const ZipEntry* a, const ZipEntry* b)
+{
+    unsigned int len = a->fileNameLen < b->fileNameLen ?
+            a->fileNameLen : b->fileNameLen;
+    int diff = memcmp(a->fileName, b->fileName, len);
+    if (diff == 0) {
+        diff = (int)a->fileNameLen - (int)b->fileNameLen;
+    }
+    return diff;
+}
+
+/*
+ * Stable sort of the entries by name.  Central directories are almost
+ * always written in order already, so check for that first; otherwise
+ * do a bottom-up merge sort, O(n log n) with one scratch array.
+ */
+static bool sortEntries(ZipEntry* pEntries, unsigned int numEntries)
+{
+    unsigned int i;
+    for (i = 1; i < numEntries; i++) {
+        if (compareEntryNames(&pEntries[i-1], &pEntries[i]) > 0) {
+            break;
+        }
+    }
+    if (i >= numEntries) {
+        return true;
+    }
+
+    ZipEntry* scratch = (ZipEntry*) malloc(numEntries * sizeof(ZipEntry));
+    if (scratch == NULL) {
+        return false;
+    }
+    ZipEntry* src = pEntries;
+    ZipEntry* dst = scratch;
+    unsigned int width;
+    for (width = 1; width < numEntries; width *= 2) {
+        unsigned int lo;
+        for (lo = 0; lo < numEntries; lo += 2 * width) {
+            unsigned int mid = lo + width < numEntries ? lo + width : numEntries;
+            unsigned int hi = mid + width < numEntries ? mid + width : numEntries;
+            unsigned int l = lo, r = mid, out = lo;
+            while (l < mid && r < hi) {
+                if (compareEntryNames(&src[r], &src[l]) < 0) {
+                    dst[out++] = src[r++];
+                } else {
+                    dst[out++] = src[l++];
+                }
+            }
+            while (l < mid) dst[out++] = src[l++];
+            while (r < hi) dst[out++] = src[r++];
+        }
+        ZipEntry* tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != pEntries) {
+        memcpy(pEntries, src, numEntries * sizeof(ZipEntry));
+    }
+    free(scratch);
+    return true;
+}
+#endif
+
+/*
+ * Find the EOCD.  Only the archive comment, at most 64 KB, can follow
+ * it, so there's no point looking any further back than that.
+ *
+ * Returns NULL if there isn't one.
+ */
+static const unsigned char* findEndOfCentralDir(const unsigned char* addr,
+        size_t length)
+{
+    size_t pos, stop;
+
+    if (length < ENDHDR)
+        return NULL;
+    pos = length - ENDHDR;
+    stop = pos > 0xffff ? pos - 0xffff : 0;
+    for (;; pos--) {
+        if (addr[pos] == (ENDSIG & 0xff) && get4LE(addr + pos) == ENDSIG)
+            return addr + pos;
+        if (pos == stop)
+            return NULL;
+    }
+}
+
 /*
  * Parse the contents of a Zip archive.  After confirming that the file
  * is in fact a Zip, we scan out the contents of the central directory and
@@ -190,6 +325,10 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
     const unsigned char* ptr;
     unsigned int i, numEntries, cdOffset;
     unsigned int val;
+    size_t eocdOffset;
+
+    pArchive->addr = (const unsigned char*) pMap->addr;
+    pArchive->length = pMap->length;
 
     /*
      * The first 4 bytes of the file will either be the local header
@@ -209,18 +348,20 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
      * Find the EOCD.  We'll find it immediately unless they have a file
      * comment.
      */
-    ptr = pMap->addr + pMap->length - ENDHDR;
-
-    while (ptr >= (const unsigned char*) pMap->addr) {
-        if (*ptr == (ENDSIG & 0xff) && get4LE(ptr) == ENDSIG)
-            break;
-        ptr--;
-    }
-    if (ptr < (const unsigned char*) pMap->addr) {
+    ptr = findEndOfCentralDir(pArchive->addr, pArchive->length);
+    if (ptr == NULL) {
         LOGI("Could not find end-of-central-directory in Zip\n");
         goto bail;
     }
 
+    /*
+     * Everything in the EOCD but the comment length is signed; with a
+     * verifier, the central directory must also sit right before it.
+     */
+    eocdOffset = ptr - (const unsigned char*)pMap->addr;
+    if (!verifyZipRange(pArchive, eocdOffset, ENDCOM))
+        goto bail;
+
     /*
      * There are two interesting items in the EOCD block: the number of
      * entries in the file, and the file offset of the start of the
@@ -236,13 +377,18 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
         goto bail;
     }
 
+    if (pArchive->verifyRange != NULL) {
+        if (cdOffset > eocdOffset ||
+            !verifyZipRange(pArchive, cdOffset, eocdOffset - cdOffset))
+            goto bail;
+    }
+
     /*
      * Create data structures to hold entries.
      */
     pArchive->numEntries = numEntries;
     pArchive->pEntries = (ZipEntry*) calloc(numEntries, sizeof(ZipEntry));
-    pArchive->pHash = mzHashTableCreate(mzHashSize(numEntries), NULL);
-    if (pArchive->pEntries == NULL || pArchive->pHash == NULL)
+    if (pArchive->pEntries == NULL)
         goto bail;
 
     ptr = pMap->addr + cdOffset;
@@ -275,58 +421,7 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if SORT_ENTRIES
-        /* Figure out where this entry should go (binary search).
-         */
-        if (i > 0) {
-            int low, high;
-
-            low = 0;
-            high = i - 1;
-            while (low <= high) {
-                int mid;
-                int diff;
-                int diffLen;
-
-                mid = low + ((high - low) / 2); // avoid overflow
-
-                if (pArchive->pEntries[mid].fileNameLen < fileNameLen) {
-                    diffLen = pArchive->pEntries[mid].fileNameLen;
-                } else {
-                    diffLen = fileNameLen;
-                }
-                diff = strncmp(pArchive->pEntries[mid].fileName, fileName,
-                        diffLen);
-                if (diff == 0) {
-                    diff = pArchive->pEntries[mid].fileNameLen - fileNameLen;
-                }
-                if (diff < 0) {
-                    low = mid + 1;
-                } else if (diff > 0) {
-                    high = mid - 1;
-                } else {
-                    high = mid;
-                    break;
-                }
-            }
-
-            unsigned int target = high + 1;
-            assert(target <= i);
-            if (target != i) {
-                /* It belongs somewhere other than at the end of
-                 * the list.  Make some room at [target].
-                 */
-                memmove(pArchive->pEntries + target + 1,
-                        pArchive->pEntries + target,
-                        (i - target) * sizeof(ZipEntry));
-            }
-            pEntry = &pArchive->pEntries[target];
-        } else {
-            pEntry = &pArchive->pEntries[0];
-        }
-#else
         pEntry = &pArchive->pEntries[i];
-#endif
 
         //LOGI("%d: localHdr=%d fnl=%d el=%d cl=%d\n",
         //    i, localHdrOffset, fileNameLen, extraLen, commentLen);
@@ -364,6 +459,8 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             LOGW("Bad offset to local header: %d (at %d)\n", localHdrOffset, i);
             goto bail;
         }
+        if (!verifyZipRange(pArchive, localHdrOffset, LOCHDR))
+            goto bail;
         if (get4LE(localHdr) != LOCSIG) {
             LOGW("Missed a local header sig (at %d)\n", i);
             goto bail;
@@ -379,40 +476,337 @@ static bool parseZipArchive(ZipArchive* pArchive, const MemMapping* pMap)
             goto bail;
         }
 
-#if !SORT_ENTRIES
-        /* Add to hash table; no need to lock here.
-         * Can't do this now if we're sorting, because entries
-         * will move around.
-         */
-        addEntryToHashTable(pArchive->pHash, pEntry);
-#endif
-
         //dumpEntry(pEntry);
         ptr += CENHDR + fileNameLen + extraLen + commentLen;
     }
 
 #if SORT_ENTRIES
-    /* If we're sorting, we have to wait until all entries
-     * are in their final places, otherwise the pointers will
-     * probably point to the wrong things.
+    /* Sort by name now that everything is parsed, then index: the
+     * index refers to entries by position.
      */
-    for (i = 0; i < numEntries; i++) {
-        /* Add to hash table; no need to lock here.
-         */
-        addEntryToHashTable(pArchive->pHash, &pArchive->pEntries[i]);
+    if (!sortEntries(pArchive->pEntries, numEntries)) {
+        LOGW("Can't sort %u entries\n", numEntries);
+        goto bail;
     }
 #endif
+    if (!buildNameIndex(pArchive))
+        goto bail;
 
     result = true;
 
 bail:
     if (!result) {
-        mzHashTableFree(pArchive->pHash);
-        pArchive->pHash = NULL;
+        free(pArchive->pIndex);
+        pArchive->pIndex = NULL;
+    }
+    return result;
+}
+
+/*
+ * Index files.  An index holds the sorted entries parseZipArchive() works
+ * out, so another process opening the same package can skip the parsing.
+ * Data offsets depend on the local headers, which nothing else ties the
+ * index to, so each one is checked against its local header on load.
+ * The name index is rebuilt from the entries on load; it's cheap, and a
+ * table read from a file couldn't be trusted to terminate a probe.
+ *
+ * It's only a cache, written and read on the same device, so it is in
+ * native byte order.  It is tied to the package by device, inode, size
+ * and mtime, and by the position, size and CRC of the central directory,
+ * and carries a CRC of its own contents.  Only the most recently written
+ * index is kept, since MZ_INDEX_DIR is usually in RAM.
+ */
+#define ZIP_INDEX_MAGIC "MZI3"
+#define ZIP_INDEX_PREFIX ".mzindex-"
+
+typedef struct {
+    char        magic[4];
+    uint32_t    numEntries;
+    uint32_t    cdOffset;
+    uint32_t    cdSize;
+    uint32_t    cdCrc;
+    uint32_t    indexCrc;       // of everything after the header
+    uint64_t    fileSize;
+    int64_t     mtimeSec;
+    int64_t     mtimeNsec;
+} ZipIndexHeader;
+
+typedef struct {
+    uint32_t    nameOffset;     // of the name within the package
+    uint32_t    nameLen;
+    uint32_t    localHdrOffset;
+    uint32_t    offset;         // of the data, past the local header
+    uint32_t    compLen;
+    uint32_t    uncompLen;
+    uint32_t    modTime;
+    uint32_t    crc32;
+    uint32_t    externalFileAttributes;
+    uint16_t    compression;
+    uint16_t    versionMadeBy;
+} ZipIndexRecord;
+
+static void zipIndexPath(const struct stat* st, char* buf, size_t bufLen)
+{
+    snprintf(buf, bufLen, "%s/" ZIP_INDEX_PREFIX "%llx-%llx", MZ_INDEX_DIR,
+            (unsigned long long) st->st_dev, (unsigned long long) st->st_ino);
+}
+
+/*
+ * Fill in the parts of an index header that tie it to the package.
+ */
+static bool initZipIndexHeader(ZipIndexHeader* pHeader,
+        const unsigned char* addr, size_t length, const struct stat* st)
+{
+    const unsigned char* eocd = findEndOfCentralDir(addr, length);
+    size_t eocdOffset;
+
+    memset(pHeader, 0, sizeof(*pHeader));
+    if (eocd == NULL)
+        return false;
+    eocdOffset = eocd - addr;
+    memcpy(pHeader->magic, ZIP_INDEX_MAGIC, sizeof(pHeader->magic));
+    pHeader->numEntries = get2LE(eocd + ENDSUB);
+    pHeader->cdOffset = get4LE(eocd + ENDOFF);
+    pHeader->cdSize = get4LE(eocd + ENDSIZ);
+    if (pHeader->cdOffset > eocdOffset ||
+            pHeader->cdSize > eocdOffset - pHeader->cdOffset)
+        return false;
+    pHeader->cdCrc = mzCrc32(0, addr + pHeader->cdOffset, pHeader->cdSize);
+    pHeader->fileSize = st->st_size;
+    pHeader->mtimeSec = st->st_mtim.tv_sec;
+    pHeader->mtimeNsec = st->st_mtim.tv_nsec;
+    return true;
+}
+
+/*
+ * Set up "pArchive" from the index for this package, if there is a valid
+ * one.  Leaves "pArchive" untouched otherwise.
+ */
+static bool loadZipIndex(ZipArchive* pArchive, const MemMapping* pMap,
+        const struct stat* st)
+{
+    const unsigned char* addr = (const unsigned char*) pMap->addr;
+    char path[PATH_MAX];
+    MemMapping index;
+    ZipIndexHeader expected;
+    const ZipIndexHeader* pHeader;
+    const ZipIndexRecord* pRecords;
+    ZipEntry* pEntries = NULL;
+    unsigned int i;
+    int fd;
+    bool result = false;
+
+    zipIndexPath(st, path, sizeof(path));
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (sysMapFileInShmem(fd, &index) != 0) {
+        close(fd);
+        return false;
+    }
+    close(fd);
+
+    pHeader = (const ZipIndexHeader*) index.addr;
+    if (index.length < sizeof(*pHeader) ||
+            !initZipIndexHeader(&expected, addr, pMap->length, st) ||
+            memcmp(pHeader->magic, expected.magic, sizeof(expected.magic)) ||
+            pHeader->numEntries != expected.numEntries ||
+            pHeader->cdOffset != expected.cdOffset ||
+            pHeader->cdSize != expected.cdSize ||
+            pHeader->cdCrc != expected.cdCrc ||
+            pHeader->fileSize != expected.fileSize ||
+            pHeader->mtimeSec != expected.mtimeSec ||
+            pHeader->mtimeNsec != expected.mtimeNsec) {
+        LOGV("Ignoring stale index %s\n", path);
+        goto bail;
+    }
+    /* numEntries matches the EOCD's 16-bit count, so this can't wrap. */
+    if (pHeader->numEntries == 0 ||
+            index.length != sizeof(*pHeader)
+                + (size_t) pHeader->numEntries * sizeof(ZipIndexRecord)) {
+        LOGW("Ignoring malformed index %s\n", path);
+        goto bail;
+    }
+    pRecords = (const ZipIndexRecord*) (pHeader + 1);
+    if (mzCrc32(0, (const unsigned char*) pRecords,
+            index.length - sizeof(*pHeader)) != pHeader->indexCrc) {
+        LOGW("Ignoring corrupt index %s\n", path);
+        goto bail;
+    }
+
+    pEntries = (ZipEntry*) calloc(pHeader->numEntries, sizeof(ZipEntry));
+    if (pEntries == NULL)
+        goto bail;
+
+    /* Trust nothing in it that could take us outside the package. */
+    for (i = 0; i < pHeader->numEntries; i++) {
+        const ZipIndexRecord* pRecord = &pRecords[i];
+        ZipEntry* pEntry = &pEntries[i];
+
+        const unsigned char* localHdr = addr + pRecord->localHdrOffset;
+
+        if ((uint64_t) pRecord->nameOffset + pRecord->nameLen > pMap->length ||
+                (uint64_t) pRecord->offset + pRecord->compLen > pMap->length ||
+                (uint64_t) pRecord->localHdrOffset + LOCHDR > pMap->length ||
+                !validFilename((const char*) addr + pRecord->nameOffset,
+                        pRecord->nameLen)) {
+            LOGW("Ignoring malformed index %s\n", path);
+            goto bail;
+        }
+        /* Same central directory doesn't mean same local headers. */
+        if (get4LE(localHdr) != LOCSIG ||
+                (uint64_t) pRecord->localHdrOffset + LOCHDR
+                    + get2LE(localHdr + LOCNAM) + get2LE(localHdr + LOCEXT)
+                    != pRecord->offset) {
+            LOGV("Ignoring stale index %s\n", path);
+            goto bail;
+        }
+        pEntry->fileName = (const char*) addr + pRecord->nameOffset;
+        pEntry->fileNameLen = pRecord->nameLen;
+        pEntry->offset = pRecord->offset;
+        pEntry->compLen = pRecord->compLen;
+        pEntry->uncompLen = pRecord->uncompLen;
+        pEntry->compression = pRecord->compression;
+        pEntry->modTime = pRecord->modTime;
+        pEntry->crc32 = pRecord->crc32;
+        pEntry->versionMadeBy = pRecord->versionMadeBy;
+        pEntry->externalFileAttributes = pRecord->externalFileAttributes;
+#if SORT_ENTRIES
+        /* mzFindZipEntryRange() binary-searches on this. */
+        if (i > 0 && compareEntryNames(&pEntries[i-1], pEntry) > 0) {
+            LOGW("Ignoring unsorted index %s\n", path);
+            goto bail;
+        }
+#endif
+    }
+
+    pArchive->addr = addr;
+    pArchive->length = pMap->length;
+    pArchive->numEntries = pHeader->numEntries;
+    pArchive->pEntries = pEntries;
+    if (!buildNameIndex(pArchive)) {
+        pArchive->pEntries = NULL;
+        pArchive->numEntries = 0;
+        goto bail;
     }
+    pEntries = NULL;
+    result = true;
+
+bail:
+    free(pEntries);
+    sysReleaseShmem(&index);
+    if (!result)
+        unlink(path);
     return result;
 }
 
+/*
+ * Remove every index in MZ_INDEX_DIR except the one at "keep", and any
+ * temporary files being written for it.  Packages are rarely opened
+ * more than one at a time, and the others' indexes would otherwise stay
+ * in RAM until reboot.
+ */
+static void removeOtherZipIndexes(const char* keep)
+{
+    const char* keepName = strrchr(keep, '/') + 1;
+    size_t keepLen = strlen(keepName);
+    struct dirent* de;
+    DIR* dir;
+
+    dir = opendir(MZ_INDEX_DIR);
+    if (dir == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        if (strncmp(de->d_name, ZIP_INDEX_PREFIX,
+                    sizeof(ZIP_INDEX_PREFIX) - 1) != 0 ||
+                (strncmp(de->d_name, keepName, keepLen) == 0 &&
+                    (de->d_name[keepLen] == '\0' ||
+                     de->d_name[keepLen] == '.')))
+            continue;
+        if (unlinkat(dirfd(dir), de->d_name, 0) == 0)
+            LOGV("Removed old index %s/%s\n", MZ_INDEX_DIR, de->d_name);
+    }
+    closedir(dir);
+}
+
+/*
+ * Write an index for the archive open in "pArchive", identified by "st".
+ * It's written under a temporary name and renamed into place, so readers
+ * never see part of one.
+ */
+static bool writeZipIndex(const ZipArchive* pArchive, const struct stat* st)
+{
+    char path[PATH_MAX], tmpPath[PATH_MAX + 16];
+    ZipIndexHeader header;
+    ZipIndexRecord* pRecords;
+    size_t recordsLen;
+    unsigned int i;
+    int fd;
+    bool ok;
+
+    if (!initZipIndexHeader(&header, pArchive->addr, pArchive->length, st) ||
+            header.numEntries != pArchive->numEntries)
+        return false;
+
+    recordsLen = pArchive->numEntries * sizeof(ZipIndexRecord);
+    pRecords = (ZipIndexRecord*) calloc(pArchive->numEntries,
+            sizeof(ZipIndexRecord));
+    if (pRecords == NULL)
+        return false;
+    for (i = 0; i < pArchive->numEntries; i++) {
+        const ZipEntry* pEntry = &pArchive->pEntries[i];
+        ZipIndexRecord* pRecord = &pRecords[i];
+
+        pRecord->nameOffset =
+                (const unsigned char*) pEntry->fileName - pArchive->addr;
+        pRecord->nameLen = pEntry->fileNameLen;
+        /* fileName points into the entry's central directory record. */
+        pRecord->localHdrOffset = get4LE((const unsigned char*)
+                pEntry->fileName - CENHDR + CENOFF);
+        pRecord->offset = pEntry->offset;
+        pRecord->compLen = pEntry->compLen;
+        pRecord->uncompLen = pEntry->uncompLen;
+        pRecord->modTime = pEntry->modTime;
+        pRecord->crc32 = pEntry->crc32;
+        pRecord->externalFileAttributes = pEntry->externalFileAttributes;
+        pRecord->compression = pEntry->compression;
+        pRecord->versionMadeBy = pEntry->versionMadeBy;
+    }
+    header.indexCrc = mzCrc32(0, (const unsigned char*) pRecords, recordsLen);
+
+    zipIndexPath(st, path, sizeof(path));
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int) getpid());
+    fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        LOGW("Can't create index %s: %s\n", tmpPath, strerror(errno));
+        free(pRecords);
+        return false;
+    }
+    ok = TEMP_FAILURE_RETRY(write(fd, &header, sizeof(header)))
+                == (ssize_t) sizeof(header) &&
+            TEMP_FAILURE_RETRY(write(fd, pRecords, recordsLen))
+                == (ssize_t) recordsLen;
+    free(pRecords);
+    if (close(fd) != 0 || !ok || rename(tmpPath, path) != 0) {
+        LOGW("Can't write index %s: %s\n", path, strerror(errno));
+        unlink(tmpPath);
+        return false;
+    }
+    LOGV("Wrote index %s\n", path);
+    removeOtherZipIndexes(path);
+    return true;
+}
+
+bool mzWriteZipIndex(const ZipArchive* pArchive)
+{
+    struct stat st;
+
+    if (pArchive->fd < 0 || pArchive->pIndex == NULL ||
+            fstat(pArchive->fd, &st) != 0)
+        return false;
+    return writeZipIndex(pArchive, &st);
+}
+
 /*
  * Open a Zip archive and scan out the contents.
  *
@@ -427,9 +821,11 @@ bail:
  *
  * On success, we fill out the contents of "pArchive".
  */
-int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+static int openZipArchive(const char* fileName, ZipArchive* pArchive,
+        bool useIndex)
 {
     MemMapping map;
+    struct stat st;
     int err;
 
     LOGV("Opening archive '%s' %p\n", fileName, pArchive);
@@ -456,10 +852,16 @@ int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
         goto bail;
     }
 
-    if (!parseZipArchive(pArchive, &map)) {
+    if (useIndex && fstat(pArchive->fd, &st) != 0)
+        useIndex = false;
+    if (useIndex && loadZipIndex(pArchive, &map, &st)) {
+        LOGV("Opened '%s' from its index\n", fileName);
+    } else if (!parseZipArchive(pArchive, &map)) {
         err = -1;
         LOGV("Parsing '%s' failed\n", fileName);
         goto bail;
+    } else if (useIndex) {
+        writeZipIndex(pArchive, &st);
     }
 
     err = 0;
@@ -474,6 +876,105 @@ bail:
     return err;
 }
 
+int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive)
+{
+    return openZipArchive(fileName, pArchive, false);
+}
+
+int mzOpenZipArchiveIndexed(const char* fileName, ZipArchive* pArchive)
+{
+    return openZipArchive(fileName, pArchive, true);
+}
+
+/*
+ * Open a Zip archive from a mapping the caller already made with
+ * sysMapFile(), so a package that was just verified isn't mapped again.
+ *
+ * On success the archive takes over the mapping and "pMap" is cleared,
+ * so the caller can always hand it to sysReleaseShmem() afterwards.
+ */
+int mzOpenZipArchiveFromMap(const char* fileName, MemMapping* pMap,
+        ZipArchive* pArchive)
+{
+    int err;
+
+    LOGV("Opening mapped archive '%s' %p\n", fileName, pArchive);
+
+    memset(pArchive, 0, sizeof(*pArchive));
+
+    pArchive->fd = open(fileName, O_RDONLY, 0);
+    if (pArchive->fd < 0) {
+        err = errno ? errno : -1;
+        LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
+        goto bail;
+    }
+
+    if (pMap->length < ENDHDR) {
+        err = -1;
+        LOGV("File '%s' too small to be zip (%zd)\n", fileName, pMap->length);
+        goto bail;
+    }
+
+    if (!parseZipArchive(pArchive, pMap)) {
+        err = -1;
+        LOGV("Parsing '%s' failed\n", fileName);
+        goto bail;
+    }
+
+    err = 0;
+    sysCopyMap(&pArchive->map, pMap);
+    memset(pMap, 0, sizeof(*pMap));
+
+bail:
+    if (err != 0)
+        mzCloseZipArchive(pArchive);
+    return err;
+}
+
+/*
+ * Open a Zip archive from a mapping the caller keeps, authenticating each
+ * part of the file with verifyRange before it is used.
+ */
+int mzOpenZipArchiveVerified(const char* fileName, const MemMapping* pMap,
+        ZipVerifyRangeFunction verifyRange, void *cookie,
+        ZipArchive* pArchive)
+{
+    int err;
+
+    LOGV("Opening verified archive '%s' %p\n", fileName, pArchive);
+
+    memset(pArchive, 0, sizeof(*pArchive));
+    pArchive->verifyRange = verifyRange;
+    pArchive->verifyCookie = cookie;
+
+    pArchive->fd = open(fileName, O_RDONLY, 0);
+    if (pArchive->fd < 0) {
+        err = errno ? errno : -1;
+        LOGV("Unable to open '%s': %s\n", fileName, strerror(err));
+        goto bail;
+    }
+
+    if (pMap->length < ENDHDR) {
+        err = -1;
+        LOGV("File '%s' too small to be zip (%zd)\n", fileName, pMap->length);
+        goto bail;
+    }
+
+    if (!parseZipArchive(pArchive, pMap)) {
+        err = -1;
+        LOGV("Parsing '%s' failed\n", fileName);
+        goto bail;
+    }
+
+    /* pArchive->map stays empty; the mapping belongs to the caller. */
+    err = 0;
+
+bail:
+    if (err != 0)
+        mzCloseZipArchive(pArchive);
+    return err;
+}
+
 /*
  * Close a ZipArchive, closing the file and freeing the contents.
  *
@@ -490,10 +991,13 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 
     free(pArchive->pEntries);
 
-    mzHashTableFree(pArchive->pHash);
+    free(pArchive->pIndex);
 
     pArchive->fd = -1;
-    pArchive->pHash = NULL;
+    pArchive->addr = NULL;
+    pArchive->length = 0;
+    pArchive->pIndex = NULL;
+    pArchive->indexMask = 0;
     pArchive->pEntries = NULL;
 }
 
@@ -505,10 +1009,80 @@ void mzCloseZipArchive(ZipArchive* pArchive)
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName)
 {
-    unsigned int itemHash = computeHash(entryName, strlen(entryName));
+    size_t nameLen = strlen(entryName);
+    uint64_t h;
+    unsigned int tag, slot;
+
+    if (pArchive->pIndex == NULL)
+        return NULL;
+    h = hashName(entryName, nameLen);
+    tag = h >> 32;
+    for (slot = h & pArchive->indexMask; ;
+            slot = (slot + 1) & pArchive->indexMask) {
+        const ZipNameSlot* pSlot = &pArchive->pIndex[slot];
+        if (pSlot->index == 0)
+            return NULL;
+        if (pSlot->hash == tag) {
+            const ZipEntry* pEntry = &pArchive->pEntries[pSlot->index - 1];
+            if (pEntry->fileNameLen == nameLen &&
+                    memcmp(pEntry->fileName, entryName, nameLen) == 0)
+                return pEntry;
+        }
+    }
+}
+
+#if !SORT_ENTRIES
+#error "mzFindZipEntryRange() needs the entries sorted by name"
+#endif
+
+/*
+ * Compare the start of an entry's name against prefix: 0 if the name
+ * begins with it, otherwise which side of it the entry sorts on.
+ */
+static int comparePrefix(const ZipEntry* pEntry, const char* prefix,
+        unsigned int prefixLen)
+{
+    unsigned int len = pEntry->fileNameLen < prefixLen ?
+            pEntry->fileNameLen : prefixLen;
+    int diff = memcmp(pEntry->fileName, prefix, len);
+    if (diff == 0 && pEntry->fileNameLen < prefixLen) {
+        diff = -1;
+    }
+    return diff;
+}
 
-    return (const ZipEntry*)mzHashTableLookup(pArchive->pHash,
-                itemHash, (char*) entryName, hashcmpZipName, false);
+/*
+ * Find the entries whose names begin with prefix, with two binary
+ * searches over the sorted entries.
+ */
+unsigned int mzFindZipEntryRange(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* first)
+{
+    unsigned int prefixLen = strlen(prefix);
+    unsigned int low = 0, high = pArchive->numEntries;
+
+    /* first entry not before the prefix */
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    *first = low;
+
+    /* first entry after all the matches */
+    high = pArchive->numEntries;
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        if (comparePrefix(&pArchive->pEntries[mid], prefix, prefixLen) <= 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low - *first;
 }
 
 /*
@@ -522,47 +1096,61 @@ bool mzIsZipEntrySymlink(const ZipEntry* pEntry)
     return false;
 }
 
+/* Compare the CRC computed while reading an entry with the one the
+ * central directory gives.
+ */
+static bool checkEntryCrc(const ZipEntry *pEntry, unsigned long crc)
+{
+    if (crc != (unsigned long)pEntry->crc32) {
+        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
+                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
+        return false;
+    }
+    return true;
+}
+
 /* Call processFunction on the uncompressed data of a STORED entry.
+ *
+ * The data is handed out straight from the archive's mapping rather than
+ * copied through a buffer, in as few calls as the int length allows.
+ * parseZipArchive() already checked that it lies inside the mapping.
  */
 static bool processStoredEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+    void *cookie, unsigned long *pCrc)
 {
+    const size_t maxCount = 1024 * 1024 * 1024;
     size_t bytesLeft = pEntry->compLen;
+    size_t offset = pEntry->offset;
     while (bytesLeft > 0) {
-        unsigned char buf[32 * 1024];
-        ssize_t n;
-        size_t count;
-        bool ret;
-
-        count = bytesLeft;
-        if (count > sizeof(buf)) {
-            count = sizeof(buf);
+        size_t count = bytesLeft;
+        if (count > maxCount) {
+            count = maxCount;
         }
-        n = read(pArchive->fd, buf, count);
-        if (n < 0 || (size_t)n != count) {
-            LOGE("Can't read %zu bytes from zip file: %ld\n", count, n);
+        if (!verifyZipRange(pArchive, offset, count)) {
             return false;
         }
-        ret = processFunction(buf, n, cookie);
-        if (!ret) {
+        *pCrc = mzCrc32(*pCrc, pArchive->addr + offset, count);
+        if (!processFunction(pArchive->addr + offset, count, cookie)) {
             return false;
         }
         bytesLeft -= count;
+        offset += count;
     }
     return true;
 }
 
 static bool processDeflatedEntry(const ZipArchive *pArchive,
     const ZipEntry *pEntry, ProcessZipEntryContentsFunction processFunction,
-    void *cookie)
+    void *cookie, unsigned long *pCrc)
 {
+    const long maxInput = 32 * 1024;
     long result = -1;
-    unsigned char readBuf[32 * 1024];
     unsigned char procBuf[32 * 1024];
     z_stream zstream;
     int zerr;
     long compRemaining;
+    size_t offset = pEntry->offset;
 
     compRemaining = pEntry->compLen;
 
@@ -598,23 +1186,22 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
      * Loop while we have data.
      */
     do {
-        /* read as much as we can */
+        /* feed the next piece of the mapping */
         if (zstream.avail_in == 0) {
-            long getSize = (compRemaining > (long)sizeof(readBuf)) ?
-                        (long)sizeof(readBuf) : compRemaining;
+            long getSize = (compRemaining > maxInput) ?
+                        maxInput : compRemaining;
             LOGVV("+++ reading %ld bytes (%ld left)\n",
                 getSize, compRemaining);
 
-            int cc = read(pArchive->fd, readBuf, getSize);
-            if (cc != (int) getSize) {
-                LOGW("inflate read failed (%d vs %ld)\n", cc, getSize);
+            if (!verifyZipRange(pArchive, offset, getSize)) {
                 goto z_bail;
             }
 
-            compRemaining -= getSize;
-
-            zstream.next_in = readBuf;
+            zstream.next_in = (Bytef*) pArchive->addr + offset;
             zstream.avail_in = getSize;
+
+            compRemaining -= getSize;
+            offset += getSize;
         }
 
         /* uncompress the data */
@@ -630,6 +1217,7 @@ static bool processDeflatedEntry(const ZipArchive *pArchive,
         {
             long procSize = zstream.next_out - procBuf;
             LOGVV("+++ processing %d bytes\n", (int) procSize);
+            *pCrc = mzCrc32(*pCrc, procBuf, procSize);
             bool ret = processFunction(procBuf, procSize, cookie);
             if (!ret) {
                 LOGW("Process function elected to fail (in inflate)\n");
@@ -667,6 +1255,10 @@ bail:
  * If processFunction returns false, the operation is abandoned and
  * mzProcessZipEntryContents() immediately returns false.
  *
+ * The entry's CRC is computed on the data as it goes by; if it doesn't
+ * match the central directory, mzProcessZipEntryContents() returns false
+ * (after processFunction has seen all the data).
+ *
  * This is useful for calculating the hash of an entry's uncompressed contents.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
@@ -674,20 +1266,16 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
     void *cookie)
 {
     bool ret = false;
-    off_t oldOff;
-
-    /* save current offset */
-    oldOff = lseek(pArchive->fd, 0, SEEK_CUR);
-
-    /* Seek to the beginning of the entry's compressed data. */
-    lseek(pArchive->fd, pEntry->offset, SEEK_SET);
+    unsigned long crc = 0;
 
     switch (pEntry->compression) {
     case STORED:
-        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie);
+        ret = processStoredEntry(pArchive, pEntry, processFunction, cookie,
+                &crc);
         break;
     case DEFLATED:
-        ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie);
+        ret = processDeflatedEntry(pArchive, pEntry, processFunction, cookie,
+                &crc);
         break;
     default:
         LOGE("Unsupported compression type %d for entry '%s'\n",
@@ -695,15 +1283,12 @@ bool mzProcessZipEntryContents(const ZipArchive *pArchive,
         break;
     }
 
-    /* restore file offset */
-    lseek(pArchive->fd, oldOff, SEEK_SET);
-    return ret;
+    return ret && checkEntryCrc(pEntry, crc);
 }
 
-static bool crcProcessFunction(const unsigned char *data, int dataLen,
-        void *crc)
+static bool nullProcessFunction(const unsigned char *data, int dataLen,
+        void *cookie)
 {
-    *(unsigned long *)crc = crc32(*(unsigned long *)crc, data, dataLen);
     return true;
 }
 
@@ -713,22 +1298,59 @@ static bool crcProcessFunction(const unsigned char *data, int dataLen,
  */
 bool mzIsZipEntryIntact(const ZipArchive *pArchive, const ZipEntry *pEntry)
 {
-    unsigned long crc;
-    bool ret;
+    /* mzProcessZipEntryContents() does the CRC check itself. */
+    return mzProcessZipEntryContents(pArchive, pEntry, nullProcessFunction,
+            NULL);
+}
 
-    crc = crc32(0L, Z_NULL, 0);
-    ret = mzProcessZipEntryContents(pArchive, pEntry, crcProcessFunction,
-            (void *)&crc);
-    if (!ret) {
-        LOGE("Can't calculate CRC for entry\n");
+/*
+ * Read an entry whose uncompressed size is known into "buffer", which
+ * holds at least that many bytes, without going through a callback:
+ * STORED data is copied straight from the mapping and DEFLATED data is
+ * inflated by a single inflate() call over the whole compressed slice.
+ */
+static bool readEntryToBuffer(const ZipArchive *pArchive,
+    const ZipEntry *pEntry, unsigned char *buffer)
+{
+    if (!verifyZipRange(pArchive, pEntry->offset, pEntry->compLen)) {
         return false;
     }
-    if (crc != (unsigned long)pEntry->crc32) {
-        LOGW("CRC for entry %.*s (0x%08lx) != expected (0x%08lx)\n",
-                pEntry->fileNameLen, pEntry->fileName, crc, pEntry->crc32);
+    const unsigned char *data = pArchive->addr + pEntry->offset;
+
+    if (pEntry->compression == STORED) {
+        if (pEntry->compLen != pEntry->uncompLen) {
+            LOGW("Stored entry sizes differ (%ld vs %ld)\n",
+                    pEntry->compLen, pEntry->uncompLen);
+            return false;
+        }
+        memcpy(buffer, data, pEntry->compLen);
+        return checkEntryCrc(pEntry, mzCrc32(0, buffer, pEntry->uncompLen));
+    }
+
+    z_stream zstream;
+    int zerr;
+
+    memset(&zstream, 0, sizeof(zstream));
+    zerr = inflateInit2(&zstream, -MAX_WBITS);
+    if (zerr != Z_OK) {
+        LOGE("Call to inflateInit2 failed (zerr=%d)\n", zerr);
         return false;
     }
-    return true;
+    zstream.next_in = (Bytef*) data;
+    zstream.avail_in = pEntry->compLen;
+    zstream.next_out = (Bytef*) buffer;
+    zstream.avail_out = pEntry->uncompLen;
+
+    zerr = inflate(&zstream, Z_FINISH);
+    long result = zstream.total_out;
+    inflateEnd(&zstream);
+
+    if (zerr != Z_STREAM_END || result != pEntry->uncompLen) {
+        LOGW("Inflating entry failed (zerr=%d, %ld of %ld bytes)\n",
+                zerr, result, pEntry->uncompLen);
+        return false;
+    }
+    return checkEntryCrc(pEntry, mzCrc32(0, buffer, pEntry->uncompLen));
 }
 
 typedef struct {
@@ -736,73 +1358,221 @@ typedef struct {
     int bufLen;
 } CopyProcessArgs;
 
-static bool copyProcessFunction(const unsigned char *data, int dataLen,
-        void *cookie)
+static bool copyProcessFunction(const unsigned char *data, int dataLen,
+        void *cookie)
+{
+    CopyProcessArgs *args = (CopyProcessArgs *)cookie;
+    if (dataLen <= args->bufLen) {
+        memcpy(args->buf, data, dataLen);
+        args->buf += dataLen;
+        args->bufLen -= dataLen;
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Read an entry into a buffer allocated by the caller.
+ */
+bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
+        char *buf, int bufLen)
+{
+    CopyProcessArgs args;
+    bool ret;
+
+    if ((pEntry->compression == STORED || pEntry->compression == DEFLATED) &&
+            pEntry->uncompLen <= bufLen) {
+        ret = readEntryToBuffer(pArchive, pEntry, (unsigned char *)buf);
+        if (!ret) {
+            LOGE("Can't extract entry to buffer.\n");
+        }
+        return ret;
+    }
+
+    args.buf = buf;
+    args.bufLen = bufLen;
+    ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
+            (void *)&args);
+    if (!ret) {
+        LOGE("Can't extract entry to buffer.\n");
+        return false;
+    }
+    return true;
+}
+
+static bool writeFully(int fd, const unsigned char *data, size_t dataLen)
+{
+    size_t soFar = 0;
+    while (soFar < dataLen) {
+        ssize_t n = write(fd, data+soFar, dataLen-soFar);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            LOGE("Error writing %zu bytes from zip file from %p: %s\n",
+                 dataLen-soFar, data+soFar, strerror(errno));
+            return false;
+        }
+        soFar += n;
+    }
+    return true;
+}
+
+/*
+ * Output for mzExtractZipEntryToFile().  Inflated data arrives in 32 KB
+ * pieces; it is gathered into WRITE_SINK_SIZE writes, and a regular file
+ * is preallocated to the entry's size first, so the filesystem can lay
+ * it out in one go.  Block devices are written with O_DIRECT, so a large
+ * image doesn't go through (and push everything else out of) the page
+ * cache; only whole aligned blocks are written that way, and the tail
+ * normally.
+ */
+#define WRITE_SINK_SIZE (1024 * 1024)
+#define WRITE_SINK_ALIGN 4096
+
+typedef struct {
+    int fd;
+    int oldFlags;               // fd's flags before O_DIRECT, or -1
+    unsigned char *buf;         // WRITE_SINK_ALIGN-aligned, or NULL
+    size_t used;
+} MzWriteSink;
+
+/* fallocate(2) without relying on libc for it; older bionic doesn't
+ * have the wrapper.  On 32-bit ABIs the 64-bit offset and length go in
+ * as register pairs, low word first.
+ */
+static int preallocate(int fd, off_t pos, off_t length)
+{
+#if defined(__LP64__)
+    return syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE, pos, length);
+#else
+    uint64_t p = pos, l = length;
+    return syscall(__NR_fallocate, fd, FALLOC_FL_KEEP_SIZE,
+            (uint32_t) p, (uint32_t) (p >> 32),
+            (uint32_t) l, (uint32_t) (l >> 32));
+#endif
+}
+
+static void openWriteSink(MzWriteSink *sink, int fd, long length)
+{
+    struct stat st;
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+
+    sink->fd = fd;
+    sink->oldFlags = -1;
+    sink->used = 0;
+    if (posix_memalign((void **)&sink->buf, WRITE_SINK_ALIGN,
+            WRITE_SINK_SIZE) != 0) {
+        sink->buf = NULL;       // just write each piece as it comes
+    }
+    if (pos < 0 || fstat(fd, &st) != 0) {
+        return;
+    }
+    if (S_ISREG(st.st_mode) && length > 0) {
+        if (preallocate(fd, pos, length) != 0 &&
+                errno != EOPNOTSUPP && errno != ENOSYS) {
+            LOGW("Can't preallocate %ld bytes: %s\n", length, strerror(errno));
+        }
+    } else if (S_ISBLK(st.st_mode) && sink->buf != NULL &&
+            pos % WRITE_SINK_ALIGN == 0) {
+        int flags = fcntl(fd, F_GETFL);
+        if (flags >= 0 && fcntl(fd, F_SETFL, flags | O_DIRECT) == 0) {
+            sink->oldFlags = flags;
+        }
+    }
+}
+
+/* Go back to normal writes, e.g. for a tail that isn't a whole block.
+ */
+static void endDirectWrites(MzWriteSink *sink)
 {
-    CopyProcessArgs *args = (CopyProcessArgs *)cookie;
-    if (dataLen <= args->bufLen) {
-        memcpy(args->buf, data, dataLen);
-        args->buf += dataLen;
-        args->bufLen -= dataLen;
-        return true;
+    if (sink->oldFlags >= 0) {
+        fcntl(sink->fd, F_SETFL, sink->oldFlags);
+        sink->oldFlags = -1;
     }
-    return false;
 }
 
-/*
- * Read an entry into a buffer allocated by the caller.
+/* Write out the first "len" bytes of the buffer.
  */
-bool mzReadZipEntry(const ZipArchive* pArchive, const ZipEntry* pEntry,
-        char *buf, int bufLen)
+static bool flushWriteSink(MzWriteSink *sink, size_t len)
 {
-    CopyProcessArgs args;
-    bool ret;
-
-    args.buf = buf;
-    args.bufLen = bufLen;
-    ret = mzProcessZipEntryContents(pArchive, pEntry, copyProcessFunction,
-            (void *)&args);
-    if (!ret) {
-        LOGE("Can't extract entry to buffer.\n");
-        return false;
+    const unsigned char *data = sink->buf;
+
+    if (sink->oldFlags >= 0) {
+        size_t direct = len & ~(size_t)(WRITE_SINK_ALIGN - 1);
+        if (direct > 0) {
+            ssize_t n = TEMP_FAILURE_RETRY(write(sink->fd, data, direct));
+            if (n < 0 && errno != EINVAL) {
+                LOGE("Error writing %zu bytes: %s\n", direct, strerror(errno));
+                return false;
+            }
+            if (n > 0) {
+                data += n;
+                len -= n;
+            }
+        }
+        /* The tail, and anything after a short direct write or one the
+         * device refused (EINVAL: it wants a bigger alignment), and
+         * everything from then on, is written normally.
+         */
+        if (len > 0) {
+            endDirectWrites(sink);
+        }
     }
-    return true;
+    return writeFully(sink->fd, data, len);
 }
 
-static bool writeProcessFunction(const unsigned char *data, int dataLen,
-                                 void *cookie)
+static bool writeSinkFunction(const unsigned char *data, int dataLen,
+                              void *cookie)
 {
-    int fd = (int)cookie;
+    MzWriteSink *sink = (MzWriteSink *)cookie;
+    size_t len = dataLen;
 
-    ssize_t soFar = 0;
-    while (true) {
-        ssize_t n = write(fd, data+soFar, dataLen-soFar);
-        if (n <= 0) {
-            LOGE("Error writing %ld bytes from zip file from %p: %s\n",
-                 dataLen-soFar, data+soFar, strerror(errno));
-            if (errno != EINTR) {
-              return false;
-            }
-        } else if (n > 0) {
-            soFar += n;
-            if (soFar == dataLen) return true;
-            if (soFar > dataLen) {
-                LOGE("write overrun?  (%ld bytes instead of %d)\n",
-                     soFar, dataLen);
+    /* Big pieces (STORED data comes straight from the mapping) needn't
+     * be copied, unless O_DIRECT needs an aligned buffer.
+     */
+    if (sink->buf == NULL ||
+            (sink->oldFlags < 0 && sink->used == 0 && len >= WRITE_SINK_SIZE)) {
+        return writeFully(sink->fd, data, len);
+    }
+    while (len > 0) {
+        size_t n = WRITE_SINK_SIZE - sink->used;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(sink->buf + sink->used, data, n);
+        sink->used += n;
+        data += n;
+        len -= n;
+        if (sink->used == WRITE_SINK_SIZE) {
+            if (!flushWriteSink(sink, sink->used)) {
                 return false;
             }
+            sink->used = 0;
         }
     }
+    return true;
+}
+
+static bool closeWriteSink(MzWriteSink *sink, bool ok)
+{
+    if (ok && sink->buf != NULL && sink->used > 0) {
+        ok = flushWriteSink(sink, sink->used);
+    }
+    endDirectWrites(sink);
+    free(sink->buf);
+    sink->buf = NULL;
+    return ok;
 }
 
-/*
- * Uncompress "pEntry" in "pArchive" to "fd" at the current offset.
- */
 bool mzExtractZipEntryToFile(const ZipArchive *pArchive,
     const ZipEntry *pEntry, int fd)
 {
-    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeProcessFunction,
-                                         (void*)fd);
+    MzWriteSink sink;
+    openWriteSink(&sink, fd, pEntry->uncompLen);
+    bool ret = mzProcessZipEntryContents(pArchive, pEntry, writeSinkFunction,
+                                         &sink);
+    ret = closeWriteSink(&sink, ret);
     if (!ret) {
         LOGE("Can't extract entry to file.\n");
         return false;
@@ -833,6 +1603,14 @@ static bool bufferProcessFunction(const unsigned char *data, int dataLen,
 bool mzExtractZipEntryToBuffer(const ZipArchive *pArchive,
     const ZipEntry *pEntry, unsigned char *buffer)
 {
+    if (pEntry->compression == STORED || pEntry->compression == DEFLATED) {
+        if (!readEntryToBuffer(pArchive, pEntry, buffer)) {
+            LOGE("Can't extract entry to memory buffer.\n");
+            return false;
+        }
+        return true;
+    }
+
     BufferExtractCookie bec;
     bec.buffer = buffer;
     bec.len = mzGetZipEntryUncompLen(pEntry);
@@ -907,6 +1685,168 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+
+/*
+ * Paging hints for extracting many entries, given with madvise() on the
+ * archive mapping.  The data of the next few entries, up to
+ * READAHEAD_WINDOW bytes past the one being written, is prefetched
+ * (WILLNEED) so reads overlap with writing; data already extracted is
+ * dropped (DONTNEED), so on low-RAM devices it doesn't push out what is
+ * still to come.  Entries are taken in the order given.
+ */
+#define READAHEAD_WINDOW (8 * 1024 * 1024)
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const ZipEntry **entries;   // in extraction order
+    unsigned int numEntries;
+    unsigned int next;          // first entry not prefetched yet
+    size_t ahead;               // bytes prefetched but not extracted
+} MzReadahead;
+
+static void adviseZipEntry(const ZipArchive *pArchive,
+        const ZipEntry *pEntry, int advice)
+{
+    uintptr_t pageSize = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t) pArchive->addr + pEntry->offset;
+    uintptr_t end = start + pEntry->compLen;
+
+    if (advice == MADV_DONTNEED) {
+        /* Only whole pages: the ends may still be wanted by neighbours. */
+        start = (start + pageSize - 1) / pageSize * pageSize;
+        end = end / pageSize * pageSize;
+    } else {
+        start = start / pageSize * pageSize;
+        end = (end + pageSize - 1) / pageSize * pageSize;
+    }
+    if (pArchive->addr == NULL || end <= start) {
+        return;
+    }
+    madvise((void *) start, end - start, advice);
+}
+
+/* Entry "index" is about to be extracted: make sure it, and the window
+ * after it, has been prefetched.
+ */
+static void readaheadStart(MzReadahead *ra, unsigned int index)
+{
+    while (ra->next < ra->numEntries &&
+            (ra->next <= index || ra->ahead < READAHEAD_WINDOW)) {
+        const ZipEntry *pEntry = ra->entries[ra->next++];
+        adviseZipEntry(ra->pArchive, pEntry, MADV_WILLNEED);
+        ra->ahead += pEntry->compLen;
+    }
+}
+
+/* Entry "index" has been extracted.
+ */
+static void readaheadDone(MzReadahead *ra, unsigned int index)
+{
+    const ZipEntry *pEntry = ra->entries[index];
+    ra->ahead -= pEntry->compLen < (long) ra->ahead ?
+            pEntry->compLen : ra->ahead;
+    adviseZipEntry(ra->pArchive, pEntry, MADV_DONTNEED);
+}
+
+/* Create a symlink at targetFile whose target is the entry's contents.
+ */
+static bool extractSymlink(const ZipArchive *pArchive,
+        const ZipEntry *pEntry, const char *targetFile)
+{
+    if (pEntry->uncompLen == 0) {
+        LOGE("Symlink entry \"%s\" has no target\n", targetFile);
+        return false;
+    }
+    char *linkTarget = malloc(pEntry->uncompLen + 1);
+    if (linkTarget == NULL) {
+        return false;
+    }
+    if (!mzReadZipEntry(pArchive, pEntry, linkTarget, pEntry->uncompLen)) {
+        LOGE("Can't read symlink target for \"%s\"\n", targetFile);
+        free(linkTarget);
+        return false;
+    }
+    linkTarget[pEntry->uncompLen] = '\0';
+
+    if (symlink(linkTarget, targetFile) != 0) {
+        LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
+                targetFile, linkTarget, strerror(errno));
+        free(linkTarget);
+        return false;
+    }
+    LOGD("Extracted symlink \"%s\" -> \"%s\"\n", targetFile, linkTarget);
+    free(linkTarget);
+    return true;
+}
+
+/* Create targetFile with the given SELinux context (may be NULL) and
+ * write the entry's contents to it.  The fs-create context is per
+ * thread, so this may run on several threads at once, as long as they
+ * don't share "dirs".  With a DirCache the file is created relative to
+ * the cached parent directory fd, saving a path walk per file.
+ */
+static bool extractFile(const ZipArchive *pArchive, const ZipEntry *pEntry,
+        const char *targetFile, const char *secontext,
+        const struct utimbuf *timestamp, DirCache *dirs)
+{
+    int dirfd = AT_FDCWD;
+    const char *name = targetFile;
+    if (dirs != NULL) {
+        dirfd = dirCacheOpenParent(dirs, targetFile, &name);
+        if (dirfd < 0) {
+            dirfd = AT_FDCWD;
+            name = targetFile;
+        }
+    }
+
+    if (secontext) {
+        setfscreatecon(secontext);
+    }
+
+    int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC,
+            UNZIP_FILEMODE);
+
+    if (secontext) {
+        setfscreatecon(NULL);
+    }
+
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    if (!ok) {
+        close(fd);
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    /* Set the times relative to the parent directory fd rather than
+     * looking the whole path up again.  (Not futimens(): older bionic
+     * doesn't have it.)
+     */
+    if (timestamp != NULL) {
+        struct timespec times[2];
+        times[0].tv_sec = timestamp->actime;
+        times[0].tv_nsec = 0;
+        times[1].tv_sec = timestamp->modtime;
+        times[1].tv_nsec = 0;
+        if (utimensat(dirfd, name, times, 0) != 0) {
+            close(fd);
+            LOGE("Error touching \"%s\"\n", targetFile);
+            return false;
+        }
+    }
+    close(fd);
+
+    LOGD("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -977,50 +1917,40 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-//TODO: since the entries are sorted, binary search for the first match
-//      and stop after the first non-match.
-     */
-    unsigned int i;
-    bool seenMatch = false;
-    int ok = true;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
+    /* Extract everything whose path begins with zpath.  If zpath is
+     * empty, that is every entry, which is what we want.
 //TODO: look out for a single empty directory entry that matches zpath, but
 //      missing the trailing slash.  Most zip files seem to include
 //      the trailing slash, but I think it's legal to leave it off.
 //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
-        }
-        /* If zpath is empty, this strncmp() will match everything,
-         * which is what we want.
-         */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
-#if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
-            continue;
+     */
+    unsigned int i, first;
+    unsigned int end = mzFindZipEntryRange(pArchive, zpath, &first);
+    end += first;
+
+    MzReadahead ra;
+    memset(&ra, 0, sizeof(ra));
+    ra.pArchive = pArchive;
+    if (!(flags & MZ_EXTRACT_DRY_RUN)) {
+        ra.entries = (const ZipEntry **)malloc(
+                (end - first) * sizeof(const ZipEntry *));
+    }
+    if (ra.entries != NULL) {
+        for (i = first; i < end; i++) {
+            ra.entries[ra.numEntries++] = pArchive->pEntries + i;
         }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
+    }
+
+    /* Most entries share their directory with the previous one, so
+     * remember which directories exist instead of checking every
+     * component of every path again.
+     */
+    DirCache dirs;
+    dirCacheInit(&dirs);
+
+    int ok = true;
+    for (i = first; i < end; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
 
         /* Find the target location of the entry.
          */
@@ -1041,11 +1971,9 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
 
         /* Create the file or directory.
          */
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
         if (pEntry->fileName[pEntry->fileNameLen-1] == '/') {
             if (!(flags & MZ_EXTRACT_FILES_ONLY)) {
-                int ret = dirCreateHierarchy(
+                int ret = dirCacheCreateHierarchy(&dirs,
                         targetFile, UNZIP_DIRMODE, timestamp, false, sehnd);
                 if (ret != 0) {
                     LOGE("Can't create containing directory for \"%s\": %s\n",
@@ -1059,7 +1987,7 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             /* This is not a directory.  First, make sure that
              * the containing directory exists.
              */
-            int ret = dirCreateHierarchy(
+            int ret = dirCacheCreateHierarchy(&dirs,
                     targetFile, UNZIP_DIRMODE, timestamp, true, sehnd);
             if (ret != 0) {
                 LOGE("Can't create containing directory for \"%s\": %s\n",
@@ -1072,91 +2000,286 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
              * so treat symlinks as regular files.
              */
             if (!(flags & MZ_EXTRACT_FILES_ONLY) && mzIsZipEntrySymlink(pEntry)) {
-                /* The entry is a symbolic link.
-                 * The relative target of the symlink is in the
-                 * data section of this entry.
-                 */
-                if (pEntry->uncompLen == 0) {
-                    LOGE("Symlink entry \"%s\" has no target\n",
-                            targetFile);
-                    ok = false;
-                    break;
-                }
-                char *linkTarget = malloc(pEntry->uncompLen + 1);
-                if (linkTarget == NULL) {
-                    ok = false;
-                    break;
-                }
-                ok = mzReadZipEntry(pArchive, pEntry, linkTarget,
-                        pEntry->uncompLen);
-                if (!ok) {
-                    LOGE("Can't read symlink target for \"%s\"\n",
-                            targetFile);
-                    free(linkTarget);
-                    break;
-                }
-                linkTarget[pEntry->uncompLen] = '\0';
-
-                /* Make the link.
-                 */
-                ret = symlink(linkTarget, targetFile);
-                if (ret != 0) {
-                    LOGE("Can't symlink \"%s\" to \"%s\": %s\n",
-                            targetFile, linkTarget, strerror(errno));
-                    free(linkTarget);
+                if (!extractSymlink(pArchive, pEntry, targetFile)) {
                     ok = false;
                     break;
                 }
-                LOGD("Extracted symlink \"%s\" -> \"%s\"\n",
-                        targetFile, linkTarget);
-                free(linkTarget);
             } else {
                 /* The entry is a regular file.
-                 * Open the target for writing.
                  */
-
                 char *secontext = NULL;
 
                 if (sehnd) {
                     selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                    setfscreatecon(secontext);
                 }
-
-                int fd = creat(targetFile, UNZIP_FILEMODE);
-
+                if (ra.entries != NULL) {
+                    readaheadStart(&ra, i - first);
+                }
+                bool extracted = extractFile(pArchive, pEntry, targetFile,
+                        secontext, timestamp, &dirs);
+                if (ra.entries != NULL) {
+                    readaheadDone(&ra, i - first);
+                }
                 if (secontext) {
                     freecon(secontext);
-                    setfscreatecon(NULL);
                 }
-
-                if (fd < 0) {
-                    LOGE("Can't create target file \"%s\": %s\n",
-                            targetFile, strerror(errno));
+                if (!extracted) {
                     ok = false;
                     break;
                 }
+            }
+        }
 
-                bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-                close(fd);
-                if (!ok) {
-                    LOGE("Error extracting \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
+        if (callback != NULL) callback(targetFile, cookie);
+    }
 
-                if (timestamp != NULL && utime(targetFile, timestamp)) {
-                    LOGE("Error touching \"%s\"\n", targetFile);
-                    ok = false;
-                    break;
-                }
+    dirCacheRelease(&dirs);
+    free(ra.entries);
+    free(helper.buf);
+    free(zpath);
+
+    return ok;
+}
+
+/* One matching entry for mzExtractRecursiveParallel().
+ */
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    char *secontext;
+    bool done;
+} MzExtractItem;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    MzExtractItem *items;
+    unsigned int numItems;
+    MzExtractItem **work;       // the regular files, by offset in the archive
+    unsigned int numWork;
+    unsigned int next;          // next index in work to hand out
+    MzReadahead ra;             // over work; guarded by lock
+    bool failed;
+    pthread_mutex_t lock;
+} MzExtractPool;
+
+static int compareItemOffsets(const void *a, const void *b)
+{
+    const ZipEntry *pEntry1 = (*(MzExtractItem * const *)a)->pEntry;
+    const ZipEntry *pEntry2 = (*(MzExtractItem * const *)b)->pEntry;
+    return (pEntry1->offset > pEntry2->offset) -
+            (pEntry1->offset < pEntry2->offset);
+}
+
+static void *extractWorker(void *cookie)
+{
+    MzExtractPool *pool = (MzExtractPool *)cookie;
+
+    while (true) {
+        pthread_mutex_lock(&pool->lock);
+        if (pool->failed || pool->next >= pool->numWork) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        unsigned int index = pool->next++;
+        MzExtractItem *item = pool->work[index];
+        readaheadStart(&pool->ra, index);
+        pthread_mutex_unlock(&pool->lock);
+
+        bool extracted = extractFile(pool->pArchive, item->pEntry,
+                item->targetFile, item->secontext, pool->timestamp, NULL);
+
+        pthread_mutex_lock(&pool->lock);
+        readaheadDone(&pool->ra, index);
+        if (extracted) {
+            item->done = true;
+        } else {
+            pool->failed = true;
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/*
+ * Like mzExtractRecursive(), but write regular files on numThreads
+ * threads.  Directories, symlinks and SELinux label lookups are done
+ * first on the calling thread; the callback runs on the calling thread
+ * afterwards, for each extracted file in archive order.
+ */
+bool mzExtractRecursiveParallel(const ZipArchive *pArchive,
+                        const char *zipDir, const char *targetDir,
+                        int flags, const struct utimbuf *timestamp,
+                        void (*callback)(const char *fn, void *), void *cookie,
+                        struct selabel_handle *sehnd, int numThreads)
+{
+    if (numThreads <= 1 || (flags & MZ_EXTRACT_DRY_RUN)) {
+        return mzExtractRecursive(pArchive, zipDir, targetDir, flags,
+                timestamp, callback, cookie, sehnd);
+    }
+    if (zipDir[0] == '/') {
+        LOGE("mzExtractRecursiveParallel(): zipDir must be a relative path.\n");
+        return false;
+    }
+    if (targetDir[0] != '/') {
+        LOGE("mzExtractRecursiveParallel(): targetDir must be an absolute path.\n");
+        return false;
+    }
+
+    unsigned int zipDirLen = strlen(zipDir);
+    char *zpath = (char *)malloc(zipDirLen + 2);
+    MzExtractPool pool;
+    memset(&pool, 0, sizeof(pool));
+    pool.pArchive = pArchive;
+    pool.timestamp = timestamp;
+    pool.items = (MzExtractItem *)calloc(pArchive->numEntries + 1,
+            sizeof(MzExtractItem));
+    pool.work = (MzExtractItem **)calloc(pArchive->numEntries + 1,
+            sizeof(MzExtractItem *));
+    pool.ra.entries = (const ZipEntry **)calloc(pArchive->numEntries + 1,
+            sizeof(const ZipEntry *));
+    if (zpath == NULL || pool.items == NULL || pool.work == NULL ||
+            pool.ra.entries == NULL) {
+        LOGE("Can't allocate extraction state for %u entries\n",
+                pArchive->numEntries);
+        free(zpath);
+        free(pool.items);
+        free(pool.work);
+        free(pool.ra.entries);
+        return false;
+    }
+    memcpy(zpath, zipDir, zipDirLen);
+    if (zipDirLen > 0 && zpath[zipDirLen-1] != '/') {
+        zpath[zipDirLen++] = '/';
+    }
+    zpath[zipDirLen] = '\0';
+
+    MzPathHelper helper;
+    helper.targetDir = targetDir;
+    helper.targetDirLen = strlen(helper.targetDir);
+    helper.zipDir = zpath;
+    helper.zipDirLen = zipDirLen;
+    helper.buf = NULL;
+    helper.bufLen = 0;
+
+    /* First pass: everything that touches directories or the label
+     * database, in archive order, queueing regular files for the workers.
+     */
+    unsigned int i, first;
+    unsigned int end = mzFindZipEntryRange(pArchive, zpath, &first);
+    end += first;
+    DirCache dirs;
+    dirCacheInit(&dirs);
+    bool ok = true;
+    for (i = first; i < end && ok; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
+
+        const char *targetFile = targetEntryPath(&helper, pEntry);
+        if (targetFile == NULL) {
+            LOGE("Can't assemble target path for \"%.*s\"\n",
+                    pEntry->fileNameLen, pEntry->fileName);
+            ok = false;
+            break;
+        }
+
+        MzExtractItem *item = &pool.items[pool.numItems++];
+        item->pEntry = pEntry;
+        item->targetFile = strdup(targetFile);
+        if (item->targetFile == NULL) {
+            ok = false;
+            break;
+        }
+
+        /* The sort is stable, so copies of a name are adjacent and in
+         * archive order.  Only the last one is written; two workers
+         * must never write the same file.
+         */
+        if (i + 1 < end &&
+                pEntry[1].fileNameLen == pEntry->fileNameLen &&
+                memcmp(pEntry[1].fileName, pEntry->fileName,
+                        pEntry->fileNameLen) == 0) {
+            item->done = true;
+            continue;
+        }
 
-                LOGD("Extracted file \"%s\"\n", targetFile);
+        bool isDir = pEntry->fileName[pEntry->fileNameLen-1] == '/';
+        if (isDir && (flags & MZ_EXTRACT_FILES_ONLY)) {
+            item->done = true;
+            continue;
+        }
+        if (dirCacheCreateHierarchy(&dirs, targetFile, UNZIP_DIRMODE,
+                timestamp, !isDir, sehnd) != 0) {
+            LOGE("Can't create containing directory for \"%s\": %s\n",
+                    targetFile, strerror(errno));
+            ok = false;
+            break;
+        }
+        if (isDir) {
+            LOGD("Extracted dir \"%s\"\n", targetFile);
+            item->done = true;
+        } else if (!(flags & MZ_EXTRACT_FILES_ONLY) &&
+                mzIsZipEntrySymlink(pEntry)) {
+            ok = extractSymlink(pArchive, pEntry, targetFile);
+            item->done = ok;
+        } else {
+            if (sehnd) {
+                selabel_lookup(sehnd, &item->secontext, targetFile,
+                        UNZIP_FILEMODE);
             }
+            pool.work[pool.numWork++] = item;
         }
+    }
+    dirCacheRelease(&dirs);
 
-        if (callback != NULL) callback(targetFile, cookie);
+    /* Second pass: write the files, front to back through the package
+     * so the readahead runs ahead of the workers.  The callback then sees
+     * every entry that was extracted, in archive order, as with the
+     * serial version.
+     */
+    if (ok && pool.numWork > 0) {
+        qsort(pool.work, pool.numWork, sizeof(MzExtractItem *),
+                compareItemOffsets);
+        pool.ra.pArchive = pArchive;
+        for (i = 0; i < pool.numWork; i++) {
+            pool.ra.entries[i] = pool.work[i]->pEntry;
+        }
+        pool.ra.numEntries = pool.numWork;
+
+        if ((unsigned int)numThreads > pool.numWork) {
+            numThreads = pool.numWork;
+        }
+        pthread_t *threads = (pthread_t *)calloc(numThreads, sizeof(pthread_t));
+        int started = 0;
+        pthread_mutex_init(&pool.lock, NULL);
+        while (threads != NULL && started < numThreads &&
+                pthread_create(&threads[started], NULL, extractWorker,
+                        &pool) == 0) {
+            ++started;
+        }
+        if (started == 0) {
+            extractWorker(&pool);
+        }
+        for (i = 0; i < (unsigned int)started; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        pthread_mutex_destroy(&pool.lock);
+        free(threads);
+        ok = !pool.failed;
     }
 
+    for (i = 0; i < pool.numItems; i++) {
+        MzExtractItem *item = &pool.items[i];
+        if (item->done && callback != NULL) {
+            callback(item->targetFile, cookie);
+        }
+        free(item->targetFile);
+        if (item->secontext) {
+            freecon(item->secontext);
+        }
+    }
+    free(pool.items);
+    free(pool.work);
+    free(pool.ra.entries);
     free(helper.buf);
     free(zpath);
 
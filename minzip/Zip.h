@@ -42,15 +42,34 @@ typedef struct ZipEntry {
     long         externalFileAttributes;
 } ZipEntry;
 
+/*
+ * Type definition for the callback used to authenticate a range of the
+ * archive file before minzip relies on it (see mzOpenZipArchiveVerified()).
+ * Returns false if the range must not be used.
+ */
+typedef bool (*ZipVerifyRangeFunction)(size_t offset, size_t length,
+    void *cookie);
+
 /*
  * One Zip archive.  Treat as opaque.
+ *
+ * Once open, an archive may be used from several threads at once: lookups
+ * and entry reads/extraction only read the archive and take all entry data
+ * from the mapping, never from the shared fd.  A verifyRange function must
+ * then be thread-safe too.  Opening and closing must not race with any
+ * other call on the same archive.
  */
 typedef struct ZipArchive {
     int         fd;
     unsigned int numEntries;
     ZipEntry*   pEntries;
-    HashTable*  pHash;          // maps file name to ZipEntry
+    struct ZipNameSlot* pIndex; // maps file name to entry; see Zip.c
+    unsigned int indexMask;     // index size - 1
     MemMapping  map;
+    const unsigned char* addr;  // the mapped file, owned or not
+    size_t      length;
+    ZipVerifyRangeFunction verifyRange;     // may be NULL
+    void*       verifyCookie;
 } ZipArchive;
 
 /*
@@ -70,6 +89,50 @@ typedef struct {
  */
 int mzOpenZipArchive(const char* fileName, ZipArchive* pArchive);
 
+/*
+ * Open a Zip archive that the caller has already mapped with sysMapFile().
+ *
+ * On success, returns 0, populates "pArchive" and takes ownership of the
+ * mapping ("pMap" is cleared).  Returns nonzero errno value on failure, in
+ * which case the caller still owns the mapping.
+ */
+int mzOpenZipArchiveFromMap(const char* fileName, MemMapping* pMap,
+        ZipArchive* pArchive);
+
+/*
+ * Open a Zip archive from a caller-owned mapping, calling verifyRange on
+ * every part of the file before it is used: the EOCD record, the central
+ * directory and local headers while parsing, and entry data as it is
+ * read.  Any range that fails makes the open or the read fail.
+ *
+ * Unlike mzOpenZipArchiveFromMap(), the caller keeps ownership of
+ * "pMap" and must keep it mapped until the archive is closed.
+ */
+int mzOpenZipArchiveVerified(const char* fileName, const MemMapping* pMap,
+        ZipVerifyRangeFunction verifyRange, void *cookie,
+        ZipArchive* pArchive);
+
+/*
+ * Index files let several processes open the same package without each
+ * parsing its central directory and local headers again.  They live in
+ * MZ_INDEX_DIR, named after the package's device and inode, and are only
+ * used while the package is unchanged; otherwise they are ignored.
+ */
+#define MZ_INDEX_DIR "/tmp"
+
+/*
+ * Like mzOpenZipArchive(), but take the entries from the package's index
+ * file if there is a valid one, and write one if not.
+ */
+int mzOpenZipArchiveIndexed(const char* fileName, ZipArchive* pArchive);
+
+/*
+ * Write the index file for an open archive, for a later
+ * mzOpenZipArchiveIndexed() of the same package.  Returns false on
+ * failure, which is harmless: the next open just parses the package.
+ */
+bool mzWriteZipIndex(const ZipArchive* pArchive);
+
 /*
  * Close archive, releasing resources associated with it.
  *
@@ -85,6 +148,16 @@ void mzCloseZipArchive(ZipArchive* pArchive);
 const ZipEntry* mzFindZipEntry(const ZipArchive* pArchive,
         const char* entryName);
 
+/*
+ * Find all entries whose names begin with "prefix" (e.g. "system/" for
+ * everything under a directory; "" matches every entry).  Entries are
+ * kept sorted by name, so the matches are contiguous: *first is set to
+ * the index of the first one, for mzGetZipEntryAt(), and the number of
+ * matches is returned.  O(log n).
+ */
+unsigned int mzFindZipEntryRange(const ZipArchive* pArchive,
+        const char* prefix, unsigned int* first);
+
 /*
  * Get the number of entries in the Zip archive.
  */
@@ -148,9 +221,17 @@ typedef bool (*ProcessZipEntryContentsFunction)(const unsigned char *data,
  * passing cookie to it each time it gets called.  processFunction
  * may be called more than once.
  *
+ * For STORED entries "data" points straight into the archive's mapping
+ * and may be large (up to 1 GB per call); it must not be written to.
+ *
  * If processFunction returns false, the operation is abandoned and
  * mzProcessZipEntryContents() immediately returns false.
  *
+ * The CRC is checked along the way (see Crc32.h), and a mismatch also
+ * makes it return false, once all the data has been processed.  So every
+ * extraction function below fails on a corrupt entry without a separate
+ * mzIsZipEntryIntact() pass.
+ *
  * This is useful for calculating the hash of an entry's uncompressed contents.
  */
 bool mzProcessZipEntryContents(const ZipArchive *pArchive,
@@ -218,6 +299,21 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
         void (*callback)(const char *fn, void*), void *cookie,
         struct selabel_handle *sehnd);
 
+/*
+ * Like mzExtractRecursive(), but regular files are inflated and written
+ * by up to numThreads worker threads.  Directories and symlinks are still
+ * created up front on the calling thread, so the resulting tree is the
+ * same as the serial version's.  The callback is invoked on the calling
+ * thread once all files are written, for the same entries and in the same
+ * order as mzExtractRecursive() would.  numThreads <= 1
+ * or MZ_EXTRACT_DRY_RUN behave exactly like mzExtractRecursive().
+ */
+bool mzExtractRecursiveParallel(const ZipArchive *pArchive,
+        const char *zipDir, const char *targetDir,
+        int flags, const struct utimbuf *timestamp,
+        void (*callback)(const char *fn, void*), void *cookie,
+        struct selabel_handle *sehnd, int numThreads);
+
 #ifdef __cplusplus
 }
 #endif
@@ -16,6 +16,8 @@
 #include <sys/limits.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mount.h>
+#include <sys/resource.h>
 
 #include <signal.h>
 #include <sys/wait.h>
@@ -24,6 +26,7 @@
 
 #include "bootloader.h"
 #include "common.h"
+#include "cutils/iosched_policy.h"
 #include "cutils/properties.h"
 #include "firmware.h"
 #include "install.h"
@@ -65,6 +68,222 @@ static int print_and_error(const char* message) {
     return 1;
 }
 
+static void build_configuration_path(char *path_buf, const char *file) {
+    sprintf(path_buf, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), file);
+}
+
+static int read_configuration_file(const char *file, char *buf, size_t len) {
+    char path[PATH_MAX];
+    build_configuration_path(path, file);
+    ensure_path_mounted(path);
+    FILE* f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    size_t count = fread(buf, 1, len - 1, f);
+    fclose(f);
+    buf[count] = '\0';
+    return 0;
+}
+
+unsigned nandroid_get_io_priority() {
+    char value[16];
+    if (read_configuration_file(NANDROID_IO_PRIORITY_FILE, value, sizeof(value)) != 0)
+        return NANDROID_IO_PRIORITY_NORMAL;
+    if (strncmp(value, "idle", 4) == 0)
+        return NANDROID_IO_PRIORITY_IDLE;
+    if (strncmp(value, "low", 3) == 0)
+        return NANDROID_IO_PRIORITY_LOW;
+    return NANDROID_IO_PRIORITY_NORMAL;
+}
+
+// per-device bandwidth cap in MB/s, 0 means unlimited
+int nandroid_get_io_bandwidth() {
+    char value[16];
+    if (read_configuration_file(NANDROID_IO_BANDWIDTH_FILE, value, sizeof(value)) != 0)
+        return 0;
+    int bandwidth = atoi(value);
+    return bandwidth > 0 ? bandwidth : 0;
+}
+
+int nandroid_get_cpu_nice() {
+    char value[16];
+    if (read_configuration_file(NANDROID_CPU_NICE_FILE, value, sizeof(value)) != 0)
+        return 0;
+    int nice_value = atoi(value);
+    if (nice_value < 0)
+        return 0;
+    return nice_value > 19 ? 19 : nice_value;
+}
+
+int nandroid_get_differential_restore() {
+    char value[16];
+    if (read_configuration_file(NANDROID_DIFFERENTIAL_RESTORE_FILE, value, sizeof(value)) != 0)
+        return 0;
+    return atoi(value) != 0;
+}
+
+// I/O scheduling for the nandroid workers.
+// ioprio and nice are per thread on Linux, so they are applied to the calling
+// thread only and get inherited by the tar/dedupe/dump children it forks.
+// The ui input thread and adbd keep running at their normal priority.
+// The bandwidth cap uses the blkio cgroup throttle on the source and target disks.
+#define NANDROID_BLKIO_ROOT "/dev/blkio"
+#define NANDROID_BLKIO_GROUP NANDROID_BLKIO_ROOT "/nandroid"
+#define NANDROID_THROTTLE_MAX_DEVICES 2
+
+static struct {
+    int depth;
+    int ioprio_changed;
+    IoSchedClass saved_class;
+    int saved_ioprio;
+    int nice_changed;
+    int saved_nice;
+    int num_devices;
+    char devices[NANDROID_THROTTLE_MAX_DEVICES][32];
+} nandroid_throttle;
+
+static int write_blkio_file(const char* dir, const char* name, const char* value) {
+    char path[PATH_MAX];
+    sprintf(path, "%s/%s", dir, name);
+    int fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return -1;
+    int ret = write(fd, value, strlen(value)) < 0 ? -1 : 0;
+    close(fd);
+    return ret;
+}
+
+static int ensure_blkio_group() {
+    struct stat st;
+    if (stat(NANDROID_BLKIO_GROUP "/tasks", &st) == 0)
+        return 0;
+
+    mkdir(NANDROID_BLKIO_ROOT, 0755);
+    if (mount("none", NANDROID_BLKIO_ROOT, "cgroup", 0, "blkio") != 0 && errno != EBUSY) {
+        LOGW("Unable to mount blkio cgroup (%s)\n", strerror(errno));
+        return -1;
+    }
+    if (mkdir(NANDROID_BLKIO_GROUP, 0755) != 0 && errno != EEXIST) {
+        LOGW("Unable to create blkio group (%s)\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+// blkio throttle rules only accept whole disks: resolve a path, or a
+// partition block device, to the "major:minor" of the disk holding it
+static int get_throttle_device(const char* path, char* device, size_t len) {
+    struct stat st;
+    if (path == NULL || stat(path, &st) != 0)
+        return -1;
+
+    dev_t dev = S_ISBLK(st.st_mode) ? st.st_rdev : st.st_dev;
+    char sys_path[PATH_MAX];
+    sprintf(sys_path, "/sys/dev/block/%u:%u/partition", major(dev), minor(dev));
+    if (access(sys_path, F_OK) != 0) {
+        snprintf(device, len, "%u:%u", major(dev), minor(dev));
+        return 0;
+    }
+
+    sprintf(sys_path, "/sys/dev/block/%u:%u/../dev", major(dev), minor(dev));
+    FILE* f = fopen(sys_path, "r");
+    if (f == NULL)
+        return -1;
+    if (fgets(device, len, f) == NULL) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    device[strcspn(device, "\n")] = '\0';
+    return 0;
+}
+
+static void add_throttle_device(const char* path, int bandwidth) {
+    char device[32];
+    char rule[64];
+    int i;
+
+    if (get_throttle_device(path, device, sizeof(device)) != 0)
+        return;
+    for (i = 0; i < nandroid_throttle.num_devices; i++) {
+        if (strcmp(nandroid_throttle.devices[i], device) == 0)
+            return;
+    }
+    if (nandroid_throttle.num_devices >= NANDROID_THROTTLE_MAX_DEVICES)
+        return;
+
+    sprintf(rule, "%s %llu", device, (unsigned long long)bandwidth * 1024 * 1024);
+    if (write_blkio_file(NANDROID_BLKIO_GROUP, "blkio.throttle.read_bps_device", rule) != 0 ||
+            write_blkio_file(NANDROID_BLKIO_GROUP, "blkio.throttle.write_bps_device", rule) != 0) {
+        LOGW("Unable to throttle device %s\n", device);
+        return;
+    }
+    strcpy(nandroid_throttle.devices[nandroid_throttle.num_devices++], device);
+}
+
+// source and target can be a mount point, a file or a block device
+static void nandroid_throttle_begin(const char* source, const char* target) {
+    if (nandroid_throttle.depth++ > 0)
+        return;
+
+    unsigned prio = nandroid_get_io_priority();
+    int nice_value = nandroid_get_cpu_nice();
+    int bandwidth = nandroid_get_io_bandwidth();
+
+    nandroid_throttle.ioprio_changed = 0;
+    nandroid_throttle.nice_changed = 0;
+    nandroid_throttle.num_devices = 0;
+
+    if (prio != NANDROID_IO_PRIORITY_NORMAL &&
+            android_get_ioprio(0, &nandroid_throttle.saved_class, &nandroid_throttle.saved_ioprio) == 0) {
+        if (prio == NANDROID_IO_PRIORITY_IDLE)
+            android_set_ioprio(0, IoSchedClass_IDLE, 7);
+        else
+            android_set_ioprio(0, IoSchedClass_BE, 7);
+        nandroid_throttle.ioprio_changed = 1;
+    }
+
+    if (nice_value != 0) {
+        errno = 0;
+        nandroid_throttle.saved_nice = getpriority(PRIO_PROCESS, 0);
+        if (errno == 0 && setpriority(PRIO_PROCESS, 0, nice_value) == 0)
+            nandroid_throttle.nice_changed = 1;
+    }
+
+    if (bandwidth > 0 && ensure_blkio_group() == 0) {
+        char tid[16];
+        add_throttle_device(source, bandwidth);
+        add_throttle_device(target, bandwidth);
+        sprintf(tid, "%d", gettid());
+        if (nandroid_throttle.num_devices > 0 && write_blkio_file(NANDROID_BLKIO_GROUP, "tasks", tid) != 0)
+            LOGW("Unable to join blkio group\n");
+    }
+}
+
+static void nandroid_throttle_end() {
+    int i;
+    if (nandroid_throttle.depth == 0 || --nandroid_throttle.depth > 0)
+        return;
+
+    if (nandroid_throttle.num_devices > 0) {
+        char buf[64];
+        sprintf(buf, "%d", gettid());
+        write_blkio_file(NANDROID_BLKIO_ROOT, "tasks", buf);
+        // a zero rate removes the rule
+        for (i = 0; i < nandroid_throttle.num_devices; i++) {
+            sprintf(buf, "%s 0", nandroid_throttle.devices[i]);
+            write_blkio_file(NANDROID_BLKIO_GROUP, "blkio.throttle.read_bps_device", buf);
+            write_blkio_file(NANDROID_BLKIO_GROUP, "blkio.throttle.write_bps_device", buf);
+        }
+        nandroid_throttle.num_devices = 0;
+    }
+
+    if (nandroid_throttle.nice_changed)
+        setpriority(PRIO_PROCESS, 0, nandroid_throttle.saved_nice);
+    if (nandroid_throttle.ioprio_changed)
+        android_set_ioprio(0, nandroid_throttle.saved_class, nandroid_throttle.saved_ioprio);
+}
+
 static int nandroid_backup_bitfield = 0;
 #define NANDROID_FIELD_DEDUPE_CLEARED_SPACE 1
 static int nandroid_files_total = 0;
@@ -174,7 +393,9 @@ void nandroid_dedupe_gc(const char* blob_dir) {
     ui_print("Freeing space...\n");
     char tmp[PATH_MAX];
     sprintf(tmp, "dedupe gc %s $(find %s -name '*.dup')", blob_dir, backup_dir);
+    nandroid_throttle_begin(blob_dir, NULL);
     __system(tmp);
+    nandroid_throttle_end();
     ui_print("Done freeing space.\n");
 }
 
@@ -213,10 +434,6 @@ static int dedupe_compress_wrapper(const char* backup_path, const char* backup_f
     return __pclose(fp);
 }
 
-static void build_configuration_path(char *path_buf, const char *file) {
-    sprintf(path_buf, "%s%s%s", get_primary_storage_path(), (is_data_media() ? "/0/" : "/"), file);
-}
-
 static nandroid_backup_handler default_backup_handler = tar_compress_wrapper;
 static char forced_backup_format[5] = "";
 void nandroid_force_backup_format(const char* fmt) {
@@ -326,7 +543,9 @@ int nandroid_backup_partition_extended(const char* backup_path, const char* moun
         ui_print("Error finding an appropriate backup handler.\n");
         return -2;
     }
+    nandroid_throttle_begin(mount_point, backup_path);
     ret = backup_handler(mount_point, tmp, callback);
+    nandroid_throttle_end();
     if (umount_when_finished) {
         ensure_path_unmounted(mount_point);
     }
@@ -357,7 +576,10 @@ int nandroid_backup_partition(const char* backup_path, const char* root) {
             sprintf(tmp, "%s/%s.img", backup_path, name);
 
         ui_print("Backing up %s image...\n", name);
-        if (0 != (ret = backup_raw_partition(vol->fs_type, vol->blk_device, tmp))) {
+        nandroid_throttle_begin(vol->blk_device, backup_path);
+        ret = backup_raw_partition(vol->fs_type, vol->blk_device, tmp);
+        nandroid_throttle_end();
+        if (0 != ret) {
             ui_print("Error while backing up %s image!", name);
             return ret;
         }
@@ -453,7 +675,10 @@ int nandroid_backup(const char* backup_path) {
 
     ui_print("Generating md5 sum...\n");
     sprintf(tmp, "nandroid-md5.sh %s", backup_path);
-    if (0 != (ret = __system(tmp))) {
+    nandroid_throttle_begin(backup_path, NULL);
+    ret = __system(tmp);
+    nandroid_throttle_end();
+    if (0 != ret) {
         ui_print("Error while generating md5 sum!\n");
         return ret;
     }
@@ -569,7 +794,7 @@ static int tar_extract_wrapper(const char* backup_file_image, const char* backup
     return do_tar_extract(tmp, callback);
 }
 
-static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+static int do_dedupe_extract(const char* mode, const char* backup_file_image, const char* backup_path, int callback) {
     char tmp[PATH_MAX];
     char blob_dir[PATH_MAX];
     strcpy(blob_dir, backup_file_image);
@@ -578,7 +803,9 @@ static int dedupe_extract_wrapper(const char* backup_file_image, const char* bac
     bd = dirname(blob_dir);
     strcpy(blob_dir, bd);
     bd = dirname(blob_dir);
-    sprintf(tmp, "dedupe x %s %s/blobs %s; exit $?", backup_file_image, bd, backup_path);
+    sprintf(tmp, "dedupe %s %s %s/blobs %s %s; exit $?", mode, backup_file_image, bd, backup_path,
+            strcmp(mode, "xd") != 0 ? "" :
+            strcmp(backup_path, "/data") == 0 && is_data_media() ? "./lost+found ./media" : "./lost+found");
 
     char path[PATH_MAX];
     FILE *fp = __popen(tmp, "r");
@@ -595,6 +822,16 @@ static int dedupe_extract_wrapper(const char* backup_file_image, const char* bac
     return __pclose(fp);
 }
 
+static int dedupe_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_dedupe_extract("x", backup_file_image, backup_path, callback);
+}
+
+// differential restore: keep unchanged files, rewrite changed ones and
+// delete files missing from the backup instead of formatting the partition
+static int dedupe_differential_extract_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
+    return do_dedupe_extract("xd", backup_file_image, backup_path, callback);
+}
+
 static int tar_undump_wrapper(const char* backup_file_image, const char* backup_path, int callback) {
     char tmp[PATH_MAX];
     sprintf(tmp, "cd $(dirname %s) ; tar xv ", backup_path);
@@ -712,8 +949,19 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
     ensure_path_mounted(path);
     int callback = stat(path, &file_info) != 0;
 
+    // Differential restore needs per file hashes, only dedupe manifests have them.
+    // The partition must already carry the filesystem the backup was made from.
+    int differential = nandroid_get_differential_restore() && restore_handler == dedupe_extract_wrapper;
+    if (differential && backup_filesystem != NULL && strcmp(vol->fs_type, backup_filesystem) != 0) {
+        ui_print("%s filesystem changed, doing a full restore.\n", mount_point);
+        differential = 0;
+    }
+
     ui_print("Restoring %s...\n", name);
-    if (backup_filesystem == NULL) {
+    if (differential) {
+        ui_print("Only changed files will be written.\n");
+        restore_handler = dedupe_differential_extract_wrapper;
+    } else if (backup_filesystem == NULL) {
         if (0 != (ret = format_volume(mount_point))) {
             ui_print("Error while formatting %s!\n", mount_point);
             return ret;
@@ -741,7 +989,10 @@ int nandroid_restore_partition_extended(const char* backup_path, const char* mou
         return -2;
     }
 
-    if (0 != (ret = restore_handler(tmp, mount_point, callback))) {
+    nandroid_throttle_begin(tmp, mount_point);
+    ret = restore_handler(tmp, mount_point, callback);
+    nandroid_throttle_end();
+    if (0 != ret) {
         ui_print("Error while restoring %s!\n", mount_point);
         return ret;
     }
@@ -778,7 +1029,10 @@ int nandroid_restore_partition(const char* backup_path, const char* root) {
             sprintf(tmp, "%s%s.img", backup_path, root);
 
         ui_print("Restoring %s image...\n", name);
-        if (0 != (ret = restore_raw_partition(vol->fs_type, vol->blk_device, tmp))) {
+        nandroid_throttle_begin(tmp, vol->blk_device);
+        ret = restore_raw_partition(vol->fs_type, vol->blk_device, tmp);
+        nandroid_throttle_end();
+        if (0 != ret) {
             ui_print("Error while flashing %s image!\n", name);
             return ret;
         }
@@ -797,13 +1051,16 @@ int nandroid_restore(const char* backup_path, int restore_boot, int restore_syst
 
     char tmp[PATH_MAX];
 
+    int ret;
+
     ui_print("Checking MD5 sums...\n");
     sprintf(tmp, "cd %s && md5sum -c nandroid.md5", backup_path);
-    if (0 != __system(tmp))
+    nandroid_throttle_begin(backup_path, NULL);
+    ret = __system(tmp);
+    nandroid_throttle_end();
+    if (0 != ret)
         return print_and_error("MD5 mismatch!\n");
 
-    int ret;
-
     if (restore_boot && NULL != volume_for_path("/boot") && 0 != (ret = nandroid_restore_partition(backup_path, "/boot")))
         return ret;
 
@@ -10,9 +10,17 @@ int nandroid_undump(const char* partition);
 void nandroid_dedupe_gc(const char* blob_dir);
 void nandroid_force_backup_format(const char* fmt);
 unsigned nandroid_get_default_backup_format();
+unsigned nandroid_get_io_priority();
+int nandroid_get_io_bandwidth();
+int nandroid_get_cpu_nice();
+int nandroid_get_differential_restore();
 
 #define NANDROID_BACKUP_FORMAT_TAR 0
 #define NANDROID_BACKUP_FORMAT_DUP 1
 #define NANDROID_BACKUP_FORMAT_TGZ 2
 
+#define NANDROID_IO_PRIORITY_NORMAL 0
+#define NANDROID_IO_PRIORITY_LOW    1
+#define NANDROID_IO_PRIORITY_IDLE   2
+
 #endif
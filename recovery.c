@@ -40,6 +40,8 @@
 #include "minzip/DirUtil.h"
 #include "roots.h"
 #include "recovery_ui.h"
+#include "verifier.h"
+#include "verifier_hash.h"
 
 #include "voldclient/voldclient.h"
 
@@ -430,8 +432,105 @@ erase_volume(const char *volume) {
     return result;
 }
 
+// Copy src to dst, hashing the part of it covered by the whole-file
+// signature on the way through.  Each chunk is read once into a
+// private buffer, and the same bytes are both hashed and written, so
+// the digest describes the copy exactly even if the source changes
+// underneath us.  Returns 0 on success.
+#define COPY_CHUNK_SIZE (1024 * 1024)
+
+static int
+copy_and_digest(const char* src, const char* dst, VerifierDigest* digest) {
+  int result = -1;
+  int in = -1, out = -1;
+  unsigned char* buffer = NULL;
+
+  in = open(src, O_RDONLY);
+  if (in < 0) {
+    LOGE("Failed to open %s (%s)\n", src, strerror(errno));
+    goto done;
+  }
+  out = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (out < 0) {
+    LOGE("Failed to open %s (%s)\n", dst, strerror(errno));
+    goto done;
+  }
+  buffer = malloc(COPY_CHUNK_SIZE);
+  if (buffer == NULL) {
+    LOGE("Failed to allocate buffer\n");
+    goto done;
+  }
+
+  // The footer says how much of the file is signed; anything past that
+  // (the signature itself) is copied but not hashed.  If the footer is
+  // bad, nothing is hashed and verification of the copy will fail.
+  struct stat st;
+  unsigned char footer[6];
+  size_t signed_len = 0;
+  if (fstat(in, &st) == 0 && st.st_size >= (off_t)sizeof(footer) &&
+      pread(in, footer, sizeof(footer), st.st_size - sizeof(footer)) ==
+          sizeof(footer)) {
+    signed_len = verifier_signed_length(footer, st.st_size);
+  }
+
+  VerifierHashCtx sha1_ctx, sha256_ctx;
+  verifier_hash_init(&sha1_ctx, SHA_DIGEST_SIZE);
+  verifier_hash_init(&sha256_ctx, SHA256_DIGEST_SIZE);
+
+  size_t so_far = 0;
+  for (;;) {
+    ssize_t r = read(in, buffer, COPY_CHUNK_SIZE);
+    if (r < 0) {
+      if (errno == EINTR) continue;
+      LOGE("Failed to read %s (%s)\n", src, strerror(errno));
+      goto done;
+    }
+    if (r == 0) break;
+
+    if (so_far < signed_len) {
+      size_t n = signed_len - so_far;
+      if (n > (size_t)r) n = r;
+      verifier_hash_update(&sha1_ctx, buffer, n);
+      verifier_hash_update(&sha256_ctx, buffer, n);
+    }
+
+    ssize_t w = 0;
+    while (w < r) {
+      ssize_t n = write(out, buffer + w, r - w);
+      if (n < 0) {
+        if (errno == EINTR) continue;
+        LOGE("Short write of %s (%s)\n", dst, strerror(errno));
+        goto done;
+      }
+      w += n;
+    }
+    so_far += r;
+  }
+
+  if (close(out) != 0) {
+    out = -1;
+    LOGE("Failed to close %s (%s)\n", dst, strerror(errno));
+    goto done;
+  }
+  out = -1;
+
+  // If the file got shorter while we were reading, the digest only
+  // covers what was actually copied; verify_file_digest() will then
+  // reject it because it won't match the copy's footer.
+  digest->signed_len = so_far < signed_len ? so_far : signed_len;
+  memcpy(digest->sha1, verifier_hash_final(&sha1_ctx), SHA_DIGEST_SIZE);
+  memcpy(digest->sha256, verifier_hash_final(&sha256_ctx), SHA256_DIGEST_SIZE);
+  result = 0;
+
+done:
+  free(buffer);
+  if (out >= 0) close(out);
+  if (in >= 0) close(in);
+  return result;
+}
+
 static char*
-copy_sideloaded_package(const char* original_path) {
+copy_sideloaded_package(const char* original_path, VerifierDigest* digest) {
   if (ensure_path_mounted(original_path) != 0) {
     LOGE("Can't mount %s\n", original_path);
     return NULL;
@@ -473,40 +572,8 @@ copy_sideloaded_package(const char* original_path) {
   strcpy(copy_path, SIDELOAD_TEMP_DIR);
   strcat(copy_path, "/package.zip");
 
-  char* buffer = malloc(BUFSIZ);
-  if (buffer == NULL) {
-    LOGE("Failed to allocate buffer\n");
-    return NULL;
-  }
-
-  size_t read;
-  FILE* fin = fopen(original_path, "rb");
-  if (fin == NULL) {
-    LOGE("Failed to open %s (%s)\n", original_path, strerror(errno));
-    return NULL;
-  }
-  FILE* fout = fopen(copy_path, "wb");
-  if (fout == NULL) {
-    LOGE("Failed to open %s (%s)\n", copy_path, strerror(errno));
-    return NULL;
-  }
-
-  while ((read = fread(buffer, 1, BUFSIZ, fin)) > 0) {
-    if (fwrite(buffer, 1, read, fout) != read) {
-      LOGE("Short write of %s (%s)\n", copy_path, strerror(errno));
-      return NULL;
-    }
-  }
-
-  free(buffer);
-
-  if (fclose(fout) != 0) {
-    LOGE("Failed to close %s (%s)\n", copy_path, strerror(errno));
-    return NULL;
-  }
-
-  if (fclose(fin) != 0) {
-    LOGE("Failed to close %s (%s)\n", original_path, strerror(errno));
+  if (copy_and_digest(original_path, copy_path, digest) != 0) {
+    unlink(copy_path);
     return NULL;
   }
 
@@ -734,12 +801,15 @@ update_directory(const char* path, const char* unmount_when_done) {
 
             ui_print("\n-- Install %s ...\n", path);
             set_sdcard_update_bootloader_message();
-            char* copy = copy_sideloaded_package(new_path);
+            VerifierDigest digest;
+            char* copy = copy_sideloaded_package(new_path, &digest);
             if (unmount_when_done != NULL) {
                 ensure_path_unmounted(unmount_when_done);
             }
             if (copy) {
-                result = install_package(copy);
+                // the copy was hashed while it was made; don't read it
+                // all again to verify it.
+                result = install_package_with_digest(copy, &digest);
                 free(copy);
             } else {
                 result = INSTALL_ERROR;
@@ -954,8 +1024,8 @@ static struct vold_callbacks v_callbacks = {
 int
 main(int argc, char **argv) {
 
-    if (argc == 2 && strcmp(argv[1], "adbd") == 0) {
-        adb_main();
+    if (argc >= 2 && strcmp(argv[1], "adbd") == 0) {
+        adb_main(argc >= 3 ? atoi(argv[2]) : -1);
         return 0;
     }
 
@@ -0,0 +1,96 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host tool: convert the text keys file written by dumpkey.jar (what
+// recovery reads as /res/keys) into the binary key store recovery maps
+// as /res/keys.bin.  Uses recovery's own parser, so the two can't
+// disagree about what the keys are.
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "verifier.h"
+
+void ui_print(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void ui_set_progress(float fraction) {
+}
+
+// Writes the store load_key_store() reads; the format is described in
+// verifier.h.
+static int write_key_store(const char* filename, const Certificate* certs,
+                           int numKeys) {
+    FILE* f = fopen(filename, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "opening %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+
+    uint32_t count = numKeys;
+    uint32_t record_size = sizeof(KeyStoreRecord);
+    fwrite(KEY_STORE_MAGIC, 1, 8, f);
+    fwrite(&count, sizeof(count), 1, f);
+    fwrite(&record_size, sizeof(record_size), 1, f);
+
+    int i;
+    for (i = 0; i < numKeys; ++i) {
+        KeyStoreRecord r;
+        memset(&r, 0, sizeof(r));
+        r.hash_len = certs[i].hash_len;
+        r.key = *certs[i].public_key;
+        fwrite(&r, sizeof(r), 1, f);
+    }
+
+    if (ferror(f) | fclose(f)) {
+        fprintf(stderr, "writing %s failed\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <keys> <keys.bin>\n", argv[0]);
+        return 2;
+    }
+
+    int num_keys;
+    Certificate* certs = load_keys(argv[1], &num_keys);
+    if (certs == NULL) {
+        fprintf(stderr, "%s: failed to parse %s\n", argv[0], argv[1]);
+        return 1;
+    }
+    if (write_key_store(argv[2], certs, num_keys) != 0) {
+        return 1;
+    }
+
+    // read it back the way recovery will
+    int check_keys;
+    Certificate* check = load_key_store(argv[2], &check_keys);
+    if (check == NULL || check_keys != num_keys) {
+        fprintf(stderr, "%s: %s doesn't read back\n", argv[0], argv[2]);
+        return 1;
+    }
+    return 0;
+}
@@ -10,3 +10,7 @@
 // nandroid settings
 #define NANDROID_HIDE_PROGRESS_FILE  "clockworkmod/.hidenandroidprogress"
 #define NANDROID_BACKUP_FORMAT_FILE  "clockworkmod/.default_backup_format"
+#define NANDROID_IO_PRIORITY_FILE    "clockworkmod/.nandroid_io_priority"
+#define NANDROID_IO_BANDWIDTH_FILE   "clockworkmod/.nandroid_io_bandwidth"
+#define NANDROID_CPU_NICE_FILE       "clockworkmod/.nandroid_cpu_nice"
+#define NANDROID_DIFFERENTIAL_RESTORE_FILE "clockworkmod/.nandroid_differential_restore"
@@ -0,0 +1,133 @@
+#!/usr/bin/env python
+
+"""Add a signed hash tree to an OTA package that has already been signed
+with "signapk -w", so that recovery can verify it a chunk at a time.
+
+The tree goes at the start of the archive comment, in front of the
+whole-file signature block; see verifier_open_hash_tree() in verifier.c
+for the layout.  The comment isn't covered by the whole-file signature,
+so that signature stays valid and older recoveries ignore the tree.
+
+usage: add_hash_tree.py [options] key.pk8 input.zip output.zip
+
+  --sha256          sign the tree with SHA-256 (match the key's cert)
+  --chunk_size N    bytes per chunk, a power of two from 4096 (default
+                    1048576)
+  --signed_len N    claim N signed bytes instead of the real length;
+                    only useful for making test packages
+
+Signing uses the openssl command line tool.
+"""
+
+import getopt
+import hashlib
+import os
+import struct
+import subprocess
+import sys
+import tempfile
+
+MAGIC = b"RCVHTREE"
+VERSION = 1
+EOCD_HEADER_SIZE = 22
+FOOTER_SIZE = 6
+RSANUMBYTES = 256
+
+
+def Usage():
+  sys.stderr.write(__doc__)
+  sys.exit(2)
+
+
+def Sign(key, data, digest):
+  """Return the PKCS#1 v1.5 signature of data, made with the DER PKCS#8
+  private key file 'key'."""
+  pem = tempfile.NamedTemporaryFile(suffix=".pem", delete=False)
+  pem.close()
+  try:
+    subprocess.check_call(["openssl", "pkcs8", "-inform", "DER", "-nocrypt",
+                           "-in", key, "-out", pem.name])
+    p = subprocess.Popen(["openssl", "dgst", "-" + digest, "-sign", pem.name],
+                         stdin=subprocess.PIPE, stdout=subprocess.PIPE)
+    sig, _ = p.communicate(data)
+    if p.returncode != 0 or len(sig) != RSANUMBYTES:
+      raise ValueError("signing failed")
+    return sig
+  finally:
+    os.unlink(pem.name)
+
+
+def AddHashTree(key, data, digest, chunk_size, signed_len=None):
+  footer = data[-FOOTER_SIZE:]
+  if len(data) < FOOTER_SIZE or footer[2:4] != b"\xff\xff":
+    raise ValueError("input has no whole-file signature")
+  signature_start, _, comment_size = struct.unpack("<HHH", footer)
+  eocd = len(data) - comment_size - EOCD_HEADER_SIZE
+  if eocd < 0 or data[eocd:eocd+4] != b"PK\x05\x06":
+    raise ValueError("can't find end of central directory")
+
+  # Same region the whole-file signature covers: everything up to the
+  # comment length field.
+  real_len = eocd + EOCD_HEADER_SIZE - 2
+  if signed_len is None:
+    signed_len = real_len
+  num_chunks = (signed_len + chunk_size - 1) // chunk_size
+
+  tree = struct.pack("<8sIIQII", MAGIC, VERSION, chunk_size, signed_len,
+                     num_chunks, 0)
+  for i in range(num_chunks):
+    start = i * chunk_size
+    end = min(start + chunk_size, real_len)
+    tree += hashlib.sha256(data[start:end]).digest()
+  tree += Sign(key, tree, digest)
+
+  # Whatever signapk put in front of its signature block (a short
+  # "signed by" note) is replaced by the tree.
+  comment = tree + data[len(data) - signature_start:]
+  if len(comment) > 0xffff:
+    raise ValueError("too many chunks; use a larger --chunk_size")
+  if comment.find(b"PK\x05\x06") != -1:
+    # the verifier rejects an EOCD marker inside the comment
+    raise ValueError("tree contains an EOCD marker; try another chunk size")
+  comment = comment[:-2] + struct.pack("<H", len(comment))
+  return data[:real_len] + struct.pack("<H", len(comment)) + comment
+
+
+def main(argv):
+  try:
+    opts, args = getopt.getopt(argv, "",
+                               ["sha256", "chunk_size=", "signed_len="])
+  except getopt.GetoptError:
+    Usage()
+  if len(args) != 3:
+    Usage()
+
+  digest = "sha1"
+  chunk_size = 1 << 20
+  signed_len = None
+  for o, a in opts:
+    if o == "--sha256":
+      digest = "sha256"
+    elif o == "--chunk_size":
+      chunk_size = int(a)
+    elif o == "--signed_len":
+      signed_len = int(a)
+  if chunk_size < 4096 or chunk_size > (64 << 20) or \
+     chunk_size & (chunk_size - 1):
+    sys.stderr.write("bad chunk size %d\n" % chunk_size)
+    sys.exit(1)
+
+  key, infile, outfile = args
+  with open(infile, "rb") as f:
+    data = f.read()
+  try:
+    out = AddHashTree(key, data, digest, chunk_size, signed_len)
+  except ValueError as e:
+    sys.stderr.write("%s: %s\n" % (infile, e))
+    sys.exit(1)
+  with open(outfile, "wb") as f:
+    f.write(out)
+
+
+if __name__ == "__main__":
+  main(sys.argv[1:])
@@ -409,9 +409,12 @@ Value* PackageExtractDirFn(const char* name, State* state,
     // To create a consistent system image, never use the clock for timestamps.
     struct utimbuf timestamp = { 1217592000, 1217592000 };  // 8/1/2008 default
 
-    bool success = mzExtractRecursive(za, zip_path, dest_path,
-                                      MZ_EXTRACT_FILES_ONLY, &timestamp,
-                                      NULL, NULL, sehandle);
+    // Files are independent, so write them on every online core.
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bool success = mzExtractRecursiveParallel(za, zip_path, dest_path,
+                                              MZ_EXTRACT_FILES_ONLY, &timestamp,
+                                              NULL, NULL, sehandle,
+                                              cpus > 0 ? (int)cpus : 1);
     free(zip_path);
     free(dest_path);
     return StringValue(strdup(success ? "t" : ""));
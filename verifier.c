@@ -20,28 +20,54 @@
 #include "mincrypt/rsa.h"
 #include "mincrypt/sha.h"
 #include "mincrypt/sha256.h"
+#include "verifier_hash.h"
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+    VerifierHashCtx ctx;
+    const unsigned char* data;
+    size_t len;
+} HashJob;
+
+static void* hash_job_thread(void* cookie) {
+    HashJob* job = (HashJob*)cookie;
+    verifier_hash_update(&job->ctx, job->data, job->len);
+    return NULL;
+}
 
-// Look for an RSA signature embedded in the .ZIP file comment given
-// the path to the zip.  Verify it matches one of the given public
-// keys.
-//
-// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
-// or no key matches the signature).
-
-int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys) {
-    ui_set_progress(0.0);
+#define FOOTER_SIZE 6
+#define EOCD_HEADER_SIZE 22
 
-    FILE* f = fopen(path, "rb");
-    if (f == NULL) {
-        LOGE("failed to open %s (%s)\n", path, strerror(errno));
-        return VERIFY_FAILURE;
+size_t verifier_signed_length(const unsigned char* footer, size_t length) {
+    if (length < FOOTER_SIZE || footer[2] != 0xff || footer[3] != 0xff) {
+        return 0;
     }
+    size_t comment_size = footer[4] + (footer[5] << 8);
+    size_t eocd_size = comment_size + EOCD_HEADER_SIZE;
+    if (length < eocd_size) {
+        return 0;
+    }
+    return length - eocd_size + EOCD_HEADER_SIZE - 2;
+}
 
+// Locate the whole-file signature at the end of the mapped package.
+// On success fills in the length of the signed region and the
+// location of the EOCD record (which holds the signature) and returns
+// 0; logs and returns -1 if the footer or EOCD is malformed.
+static int find_signature(const unsigned char* addr, size_t length,
+                          size_t* signed_len_out,
+                          const unsigned char** eocd_out,
+                          size_t* eocd_size_out) {
     // An archive with a whole-file signature will end in six bytes:
     //
     //   (2-byte signature start) $ff $ff (2-byte comment size)
@@ -51,79 +77,55 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
     // us how far back from the end we have to start reading to find
     // the whole comment.
 
-#define FOOTER_SIZE 6
-
-    if (fseek(f, -FOOTER_SIZE, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
+    if (length < FOOTER_SIZE) {
+        LOGE("not big enough for footer\n");
+        return -1;
     }
 
-    unsigned char footer[FOOTER_SIZE];
-    if (fread(footer, 1, FOOTER_SIZE, f) != FOOTER_SIZE) {
-        LOGE("failed to read footer from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    const unsigned char* footer = addr + length - FOOTER_SIZE;
 
     if (footer[2] != 0xff || footer[3] != 0xff) {
         LOGE("footer is wrong\n");
-        fclose(f);
-        return VERIFY_FAILURE;
+        return -1;
     }
 
-    int comment_size = footer[4] + (footer[5] << 8);
-    int signature_start = footer[0] + (footer[1] << 8);
+    size_t comment_size = footer[4] + (footer[5] << 8);
+    size_t signature_start = footer[0] + (footer[1] << 8);
     LOGI("comment is %d bytes; signature %d bytes from end\n",
-         comment_size, signature_start);
+         (int)comment_size, (int)signature_start);
 
-    if (signature_start - FOOTER_SIZE < RSANUMBYTES) {
+    if (signature_start < FOOTER_SIZE + RSANUMBYTES) {
         // "signature" block isn't big enough to contain an RSA block.
         LOGE("signature is too short\n");
-        fclose(f);
-        return VERIFY_FAILURE;
+        return -1;
     }
 
-#define EOCD_HEADER_SIZE 22
-
     // The end-of-central-directory record is 22 bytes plus any
     // comment length.
     size_t eocd_size = comment_size + EOCD_HEADER_SIZE;
 
-    if (fseek(f, -eocd_size, SEEK_END) != 0) {
-        LOGE("failed to seek in %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
+    if (length < eocd_size) {
+        LOGE("not big enough for EOCD\n");
+        return -1;
     }
 
     // Determine how much of the file is covered by the signature.
     // This is everything except the signature data and length, which
     // includes all of the EOCD except for the comment length field (2
     // bytes) and the comment data.
-    size_t signed_len = ftell(f) + EOCD_HEADER_SIZE - 2;
+    size_t signed_len = length - eocd_size + EOCD_HEADER_SIZE - 2;
 
-    unsigned char* eocd = malloc(eocd_size);
-    if (eocd == NULL) {
-        LOGE("malloc for EOCD record failed\n");
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
-    if (fread(eocd, 1, eocd_size, f) != eocd_size) {
-        LOGE("failed to read eocd from %s (%s)\n", path, strerror(errno));
-        fclose(f);
-        return VERIFY_FAILURE;
-    }
+    const unsigned char* eocd = addr + length - eocd_size;
 
     // If this is really is the EOCD record, it will begin with the
     // magic number $50 $4b $05 $06.
     if (eocd[0] != 0x50 || eocd[1] != 0x4b ||
         eocd[2] != 0x05 || eocd[3] != 0x06) {
         LOGE("signature length doesn't match EOCD marker\n");
-        fclose(f);
-        return VERIFY_FAILURE;
+        return -1;
     }
 
-    unsigned int i;
+    size_t i;
     for (i = 4; i < eocd_size-3; ++i) {
         if (eocd[i  ] == 0x50 && eocd[i+1] == 0x4b &&
             eocd[i+2] == 0x05 && eocd[i+3] == 0x06) {
@@ -132,13 +134,78 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
             // which could be exploitable.  Fail verification if
             // this sequence occurs anywhere after the real one.
             LOGE("EOCD marker occurs after start of EOCD\n");
-            fclose(f);
-            return VERIFY_FAILURE;
+            return -1;
+        }
+    }
+
+    *signed_len_out = signed_len;
+    *eocd_out = eocd;
+    *eocd_size_out = eocd_size;
+    return 0;
+}
+
+// The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
+// the signing tool appends after the signature itself.
+static const unsigned char* whole_file_signature(const unsigned char* eocd,
+                                                 size_t eocd_size) {
+    return eocd + eocd_size - FOOTER_SIZE - RSANUMBYTES;
+}
+
+// Check an RSANUMBYTES signature against each key, using the digest of
+// the matching type.  "what" names the signature in log messages.
+static int check_signature(const char* what, const unsigned char* sig,
+                           const uint8_t* sha1, const uint8_t* sha256,
+                           const Certificate* pKeys, unsigned int numKeys) {
+    unsigned int i;
+    for (i = 0; i < numKeys; ++i) {
+        const uint8_t* hash;
+        switch (pKeys[i].hash_len) {
+            case SHA_DIGEST_SIZE: hash = sha1; break;
+            case SHA256_DIGEST_SIZE: hash = sha256; break;
+            default: continue;
+        }
+
+        if (RSA_verify(pKeys[i].public_key, sig, RSANUMBYTES,
+                       hash, pKeys[i].hash_len)) {
+            LOGI("%s verified against key %d\n", what, (int)i);
+            return VERIFY_SUCCESS;
+        } else {
+            LOGI("failed to verify against key %d\n", (int)i);
         }
     }
+    LOGE("failed to verify %s\n", what);
+    return VERIFY_FAILURE;
+}
+
+// Look for an RSA signature embedded in the .ZIP file comment given
+// the mapped contents of the zip.  Verify it matches one of the given
+// public keys.
+//
+// Return VERIFY_SUCCESS, VERIFY_FAILURE (if any error is encountered
+// or no key matches the signature).
+
+int verify_file(const unsigned char* addr, size_t length,
+                const Certificate* pKeys, unsigned int numKeys) {
+    return verify_file_and_digest(addr, length, pKeys, numKeys, NULL);
+}
+
+int verify_file_and_digest(const unsigned char* addr, size_t length,
+                           const Certificate* pKeys, unsigned int numKeys,
+                           VerifierDigest* digest) {
+    ui_set_progress(0.0);
+
+    size_t signed_len;
+    const unsigned char* eocd;
+    size_t eocd_size;
+    if (find_signature(addr, length, &signed_len, &eocd, &eocd_size) != 0) {
+        return VERIFY_FAILURE;
+    }
 
-#define BUFFER_SIZE 4096
+    // Hash straight out of the mapping; the chunk size only controls
+    // how often the progress bar is updated.
+#define HASH_CHUNK_SIZE (1024 * 1024)
 
+    size_t i;
     bool need_sha1 = false;
     bool need_sha256 = false;
     for (i = 0; i < numKeys; ++i) {
@@ -148,30 +215,36 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
         }
     }
 
-    SHA_CTX sha1_ctx;
-    SHA256_CTX sha256_ctx;
-    SHA_init(&sha1_ctx);
-    SHA256_init(&sha256_ctx);
-    unsigned char* buffer = (unsigned char*)malloc(BUFFER_SIZE);
-    if (buffer == NULL) {
-        LOGE("failed to alloc memory for sha1 buffer\n");
-        fclose(f);
-        return VERIFY_FAILURE;
+    VerifierHashCtx sha1_ctx;
+    HashJob sha256_job;
+    verifier_hash_init(&sha1_ctx, SHA_DIGEST_SIZE);
+    verifier_hash_init(&sha256_job.ctx, SHA256_DIGEST_SIZE);
+    sha256_job.data = addr;
+    sha256_job.len = signed_len;
+
+    // With keys of both types loaded, SHA-256 runs over the whole signed
+    // region on a second thread while this one does SHA-1 and drives the
+    // progress bar.  Otherwise hash inline.
+    bool threaded = false;
+    pthread_t sha256_thread;
+    if (need_sha1 && need_sha256) {
+        threaded = pthread_create(&sha256_thread, NULL,
+                                  hash_job_thread, &sha256_job) == 0;
     }
+    LOGI("hashing %d bytes (sha1 %s, sha256 %s%s)\n", (int)signed_len,
+         need_sha1 ? verifier_hash_backend(SHA_DIGEST_SIZE) : "off",
+         need_sha256 ? verifier_hash_backend(SHA256_DIGEST_SIZE) : "off",
+         threaded ? ", threaded" : "");
 
     double frac = -1.0;
     size_t so_far = 0;
-    fseek(f, 0, SEEK_SET);
     while (so_far < signed_len) {
-        unsigned int size = BUFFER_SIZE;
+        size_t size = HASH_CHUNK_SIZE;
         if (signed_len - so_far < size) size = signed_len - so_far;
-        if (fread(buffer, 1, size, f) != size) {
-            LOGE("failed to read data from %s (%s)\n", path, strerror(errno));
-            fclose(f);
-            return VERIFY_FAILURE;
+        if (need_sha1) verifier_hash_update(&sha1_ctx, addr + so_far, size);
+        if (need_sha256 && !threaded) {
+            verifier_hash_update(&sha256_job.ctx, addr + so_far, size);
         }
-        if (need_sha1) SHA_update(&sha1_ctx, buffer, size);
-        if (need_sha256) SHA256_update(&sha256_ctx, buffer, size);
         so_far += size;
         double f = so_far / (double)signed_len;
         if (f > frac + 0.02 || size == so_far) {
@@ -179,34 +252,333 @@ int verify_file(const char* path, const Certificate* pKeys, unsigned int numKeys
             frac = f;
         }
     }
-    fclose(f);
-    free(buffer);
 
-    const uint8_t* sha1 = SHA_final(&sha1_ctx);
-    const uint8_t* sha256 = SHA256_final(&sha256_ctx);
+    if (threaded) {
+        pthread_join(sha256_thread, NULL);
+    }
 
-    for (i = 0; i < numKeys; ++i) {
-        const uint8_t* hash;
-        switch (pKeys[i].hash_len) {
-            case SHA_DIGEST_SIZE: hash = sha1; break;
-            case SHA256_DIGEST_SIZE: hash = sha256; break;
-            default: continue;
+    const uint8_t* sha1 = verifier_hash_final(&sha1_ctx);
+    const uint8_t* sha256 = verifier_hash_final(&sha256_job.ctx);
+
+    if (digest != NULL) {
+        digest->signed_len = signed_len;
+        memcpy(digest->sha1, sha1, SHA_DIGEST_SIZE);
+        memcpy(digest->sha256, sha256, SHA256_DIGEST_SIZE);
+    }
+
+    return check_signature("whole-file signature",
+                           whole_file_signature(eocd, eocd_size),
+                           sha1, sha256, pKeys, numKeys);
+}
+
+int verify_file_digest(const unsigned char* addr, size_t length,
+                       const VerifierDigest* digest,
+                       const Certificate* pKeys, unsigned int numKeys) {
+    size_t signed_len;
+    const unsigned char* eocd;
+    size_t eocd_size;
+    if (find_signature(addr, length, &signed_len, &eocd, &eocd_size) != 0) {
+        return VERIFY_FAILURE;
+    }
+
+    // The digest was taken while the package was being copied, using
+    // the footer as it was then.  It is only good if it covers exactly
+    // the region the signature in this copy says is signed.
+    if (digest->signed_len != signed_len) {
+        LOGE("digest covers %lu bytes; signature covers %lu\n",
+             (unsigned long)digest->signed_len, (unsigned long)signed_len);
+        return VERIFY_FAILURE;
+    }
+
+    ui_set_progress(1.0);
+    return check_signature("whole-file signature",
+                           whole_file_signature(eocd, eocd_size),
+                           digest->sha1, digest->sha256, pKeys, numKeys);
+}
+
+// Streaming digests: bytes arrive in file order and the total length
+// isn't known until the end, so the last VERIFIER_STREAM_TAIL bytes
+// (enough for the largest possible comment plus its length field,
+// which is all that can lie outside the signed region) are held back
+// until the footer has been seen.
+
+static void stream_hash(VerifierStream* stream, const unsigned char* data,
+                        size_t len) {
+    verifier_hash_update(&stream->sha1, data, len);
+    verifier_hash_update(&stream->sha256, data, len);
+}
+
+void verifier_stream_init(VerifierStream* stream) {
+    verifier_hash_init(&stream->sha1, SHA_DIGEST_SIZE);
+    verifier_hash_init(&stream->sha256, SHA256_DIGEST_SIZE);
+    stream->length = 0;
+    stream->tail_len = 0;
+}
+
+void verifier_stream_update(VerifierStream* stream, const void* data,
+                            size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    stream->length += len;
+    while (len > 0) {
+        size_t room = sizeof(stream->tail) - stream->tail_len;
+        if (room == 0) {
+            size_t n = stream->tail_len - VERIFIER_STREAM_TAIL;
+            stream_hash(stream, stream->tail, n);
+            memmove(stream->tail, stream->tail + n, VERIFIER_STREAM_TAIL);
+            stream->tail_len = VERIFIER_STREAM_TAIL;
+            continue;
+        }
+        size_t n = len < room ? len : room;
+        memcpy(stream->tail + stream->tail_len, p, n);
+        stream->tail_len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+int verifier_stream_finish(VerifierStream* stream, VerifierDigest* digest) {
+    if (stream->tail_len < FOOTER_SIZE) {
+        LOGE("stream too short for footer\n");
+        return VERIFY_FAILURE;
+    }
+    size_t signed_len = verifier_signed_length(
+        stream->tail + stream->tail_len - FOOTER_SIZE, stream->length);
+    size_t hashed = stream->length - stream->tail_len;
+    if (signed_len == 0 || signed_len < hashed) {
+        LOGE("stream has no valid signature footer\n");
+        return VERIFY_FAILURE;
+    }
+    stream_hash(stream, stream->tail, signed_len - hashed);
+
+    digest->signed_len = signed_len;
+    memcpy(digest->sha1, verifier_hash_final(&stream->sha1), SHA_DIGEST_SIZE);
+    memcpy(digest->sha256, verifier_hash_final(&stream->sha256),
+           SHA256_DIGEST_SIZE);
+    return VERIFY_SUCCESS;
+}
+
+// An optional hash tree may sit at the start of the archive comment,
+// ahead of the whole-file signature:
+//
+//   "RCVHTREE"            8-byte magic
+//   version               4 bytes LE, currently 1
+//   chunk_size            4 bytes LE, power of two, 4 KB .. 64 MB
+//   signed_len            8 bytes LE, same region as the whole-file signature
+//   num_chunks            4 bytes LE, ceil(signed_len / chunk_size)
+//   reserved              4 bytes, zero
+//   leaves                num_chunks SHA-256 digests, one per chunk
+//   signature             RSANUMBYTES, over everything above, made with
+//                         the same key (and hash) as the whole-file one
+//
+// The comment isn't covered by the whole-file signature, so adding the
+// tree doesn't disturb older recoveries; the tree is signed on its own.
+// Once its signature checks out, each chunk can be verified just before
+// it is used, and the chunks can be hashed in parallel.
+//
+// tools/ota/add_hash_tree.py adds a tree to a package signed with
+// "signapk -w".
+
+#define HASH_TREE_MAGIC "RCVHTREE"
+#define HASH_TREE_HEADER_SIZE 32
+#define HASH_TREE_VERSION 1
+#define HASH_TREE_MIN_CHUNK 4096
+#define HASH_TREE_MAX_CHUNK (64 * 1024 * 1024)
+
+enum { CHUNK_UNCHECKED = 0, CHUNK_GOOD, CHUNK_BAD };
+
+static uint32_t get_le32(const unsigned char* p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t get_le64(const unsigned char* p) {
+    return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+int verifier_open_hash_tree(const unsigned char* addr, size_t length,
+                            const Certificate* pKeys, unsigned int numKeys,
+                            VerifierHashTree* tree) {
+    memset(tree, 0, sizeof(*tree));
+
+    size_t signed_len;
+    const unsigned char* eocd;
+    size_t eocd_size;
+    if (find_signature(addr, length, &signed_len, &eocd, &eocd_size) != 0) {
+        return VERIFY_FAILURE;
+    }
+
+    // The tree has to fit in the comment in front of the whole-file
+    // signature block.
+    const unsigned char* footer = addr + length - FOOTER_SIZE;
+    size_t signature_start = footer[0] + (footer[1] << 8);
+    size_t comment_size = eocd_size - EOCD_HEADER_SIZE;
+    if (comment_size < signature_start) {
+        return VERIFY_FAILURE;
+    }
+    size_t room = comment_size - signature_start;
+    const unsigned char* block = eocd + EOCD_HEADER_SIZE;
+
+    if (room < HASH_TREE_HEADER_SIZE ||
+        memcmp(block, HASH_TREE_MAGIC, 8) != 0) {
+        return VERIFY_FAILURE;
+    }
+    uint32_t version = get_le32(block + 8);
+    uint32_t chunk_size = get_le32(block + 12);
+    uint64_t tree_len = get_le64(block + 16);
+    uint32_t num_chunks = get_le32(block + 24);
+
+    if (version != HASH_TREE_VERSION) {
+        LOGE("unknown hash tree version %u\n", version);
+        return VERIFY_FAILURE;
+    }
+    if (chunk_size < HASH_TREE_MIN_CHUNK || chunk_size > HASH_TREE_MAX_CHUNK ||
+        (chunk_size & (chunk_size - 1)) != 0) {
+        LOGE("bad hash tree chunk size %u\n", chunk_size);
+        return VERIFY_FAILURE;
+    }
+    if (tree_len != signed_len ||
+        num_chunks != (signed_len + chunk_size - 1) / chunk_size) {
+        LOGE("hash tree doesn't cover the signed region\n");
+        return VERIFY_FAILURE;
+    }
+    size_t tree_size = HASH_TREE_HEADER_SIZE + (size_t)num_chunks * SHA256_DIGEST_SIZE;
+    if (room < tree_size + RSANUMBYTES) {
+        LOGE("hash tree runs past the comment\n");
+        return VERIFY_FAILURE;
+    }
+
+    VerifierHashCtx sha1_ctx, sha256_ctx;
+    verifier_hash_init(&sha1_ctx, SHA_DIGEST_SIZE);
+    verifier_hash_init(&sha256_ctx, SHA256_DIGEST_SIZE);
+    verifier_hash_update(&sha1_ctx, block, tree_size);
+    verifier_hash_update(&sha256_ctx, block, tree_size);
+    if (check_signature("hash tree signature", block + tree_size,
+                        verifier_hash_final(&sha1_ctx),
+                        verifier_hash_final(&sha256_ctx),
+                        pKeys, numKeys) != VERIFY_SUCCESS) {
+        return VERIFY_FAILURE;
+    }
+
+    tree->state = calloc(num_chunks, 1);
+    if (tree->state == NULL) {
+        return VERIFY_FAILURE;
+    }
+    tree->addr = addr;
+    tree->signed_len = signed_len;
+    tree->chunk_size = chunk_size;
+    tree->num_chunks = num_chunks;
+    tree->leaves = block + HASH_TREE_HEADER_SIZE;
+    pthread_mutex_init(&tree->lock, NULL);
+    LOGI("hash tree: %u chunks of %u bytes\n", num_chunks, chunk_size);
+    return VERIFY_SUCCESS;
+}
+
+// Returns true if chunk idx matches its leaf.  Two threads may hash the
+// same chunk at once; both reach the same answer, so that's harmless.
+static bool check_chunk(VerifierHashTree* tree, size_t idx) {
+    pthread_mutex_lock(&tree->lock);
+    int state = tree->state[idx];
+    pthread_mutex_unlock(&tree->lock);
+    if (state != CHUNK_UNCHECKED) {
+        return state == CHUNK_GOOD;
+    }
+
+    size_t start = idx * tree->chunk_size;
+    size_t len = tree->signed_len - start;
+    if (len > tree->chunk_size) len = tree->chunk_size;
+
+    VerifierHashCtx ctx;
+    verifier_hash_init(&ctx, SHA256_DIGEST_SIZE);
+    verifier_hash_update(&ctx, tree->addr + start, len);
+    bool good = memcmp(verifier_hash_final(&ctx),
+                       tree->leaves + idx * SHA256_DIGEST_SIZE,
+                       SHA256_DIGEST_SIZE) == 0;
+    if (!good) {
+        LOGE("chunk %lu fails hash tree check\n", (unsigned long)idx);
+    }
+
+    pthread_mutex_lock(&tree->lock);
+    tree->state[idx] = good ? CHUNK_GOOD : CHUNK_BAD;
+    pthread_mutex_unlock(&tree->lock);
+    return good;
+}
+
+bool verifier_hash_tree_check(size_t offset, size_t length, void* cookie) {
+    VerifierHashTree* tree = (VerifierHashTree*)cookie;
+    if (offset > tree->signed_len || length > tree->signed_len - offset) {
+        return false;
+    }
+    if (length == 0) {
+        return true;
+    }
+    size_t idx;
+    for (idx = offset / tree->chunk_size;
+         idx <= (offset + length - 1) / tree->chunk_size; ++idx) {
+        if (!check_chunk(tree, idx)) {
+            return false;
         }
+    }
+    return true;
+}
 
-        // The 6 bytes is the "(signature_start) $ff $ff (comment_size)" that
-        // the signing tool appends after the signature itself.
-        if (RSA_verify(pKeys[i].public_key, eocd + eocd_size - 6 - RSANUMBYTES,
-                       RSANUMBYTES, hash, pKeys[i].hash_len)) {
-            LOGI("whole-file signature verified against key %d\n", i);
-            free(eocd);
-            return VERIFY_SUCCESS;
-        } else {
-            LOGI("failed to verify against key %d\n", i);
+static void* hash_tree_thread(void* cookie) {
+    VerifierHashTree* tree = (VerifierHashTree*)cookie;
+    for (;;) {
+        pthread_mutex_lock(&tree->lock);
+        size_t idx = tree->next_chunk++;
+        pthread_mutex_unlock(&tree->lock);
+        if (idx >= tree->num_chunks) {
+            break;
         }
+        check_chunk(tree, idx);
     }
-    free(eocd);
-    LOGE("failed to verify whole-file signature\n");
-    return VERIFY_FAILURE;
+    return NULL;
+}
+
+void verifier_hash_tree_start(VerifierHashTree* tree, int threads) {
+    if (threads < 1) {
+        return;
+    }
+    tree->threads = malloc(threads * sizeof(pthread_t));
+    if (tree->threads == NULL) {
+        return;
+    }
+    int i;
+    for (i = 0; i < threads; ++i) {
+        if (pthread_create(&tree->threads[i], NULL,
+                           hash_tree_thread, tree) != 0) {
+            break;
+        }
+    }
+    tree->num_threads = i;
+}
+
+int verifier_hash_tree_finish(VerifierHashTree* tree) {
+    int i;
+    for (i = 0; i < tree->num_threads; ++i) {
+        pthread_join(tree->threads[i], NULL);
+    }
+    free(tree->threads);
+    tree->threads = NULL;
+    tree->num_threads = 0;
+
+    // picks up anything the threads didn't get to (or if there were none)
+    size_t idx;
+    for (idx = 0; idx < tree->num_chunks; ++idx) {
+        if (!check_chunk(tree, idx)) {
+            return VERIFY_FAILURE;
+        }
+    }
+    return VERIFY_SUCCESS;
+}
+
+void verifier_close_hash_tree(VerifierHashTree* tree) {
+    if (tree->state == NULL) {
+        return;
+    }
+    verifier_hash_tree_finish(tree);
+    pthread_mutex_destroy(&tree->lock);
+    free(tree->state);
+    tree->state = NULL;
 }
 
 // Reads a file containing one or more public keys as produced by
@@ -331,3 +703,75 @@ exit:
     *numKeys = 0;
     return NULL;
 }
+
+// Key store (see verifier.h).  The store is mapped the first time it is
+// needed and stays mapped, since the certificates handed out point into
+// it.
+static const unsigned char* key_store_addr = NULL;
+static size_t key_store_length = 0;
+
+static int map_key_store(const char* filename) {
+    if (key_store_addr != NULL) {
+        return 0;
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < KEY_STORE_HEADER_SIZE) {
+        close(fd);
+        return -1;
+    }
+    void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        LOGE("mapping %s: %s\n", filename, strerror(errno));
+        return -1;
+    }
+    key_store_addr = (const unsigned char*)addr;
+    key_store_length = st.st_size;
+    return 0;
+}
+
+Certificate*
+load_key_store(const char* filename, int* numKeys) {
+    *numKeys = 0;
+    if (map_key_store(filename) != 0) {
+        return NULL;
+    }
+
+    uint32_t count, record_size;
+    memcpy(&count, key_store_addr + 8, sizeof(count));
+    memcpy(&record_size, key_store_addr + 12, sizeof(record_size));
+    if (memcmp(key_store_addr, KEY_STORE_MAGIC, 8) != 0 ||
+        record_size != sizeof(KeyStoreRecord) || count == 0 ||
+        count > (key_store_length - KEY_STORE_HEADER_SIZE) / record_size ||
+        key_store_length != KEY_STORE_HEADER_SIZE + count * record_size) {
+        LOGE("%s is not a valid key store\n", filename);
+        return NULL;
+    }
+
+    Certificate* out = (Certificate*)malloc(count * sizeof(Certificate));
+    if (out == NULL) {
+        return NULL;
+    }
+    const KeyStoreRecord* records =
+            (const KeyStoreRecord*)(key_store_addr + KEY_STORE_HEADER_SIZE);
+    uint32_t i;
+    for (i = 0; i < count; ++i) {
+        const KeyStoreRecord* r = records + i;
+        if ((r->hash_len != SHA_DIGEST_SIZE && r->hash_len != SHA256_DIGEST_SIZE) ||
+            r->key.len != RSANUMWORDS ||
+            (r->key.exponent != 3 && r->key.exponent != 65537)) {
+            LOGE("bad key %u in %s\n", i, filename);
+            free(out);
+            return NULL;
+        }
+        out[i].hash_len = r->hash_len;
+        out[i].public_key = (RSAPublicKey*)&r->key;
+    }
+    *numKeys = count;
+    return out;
+}
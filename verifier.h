@@ -17,20 +17,148 @@
 #ifndef _RECOVERY_VERIFIER_H
 #define _RECOVERY_VERIFIER_H
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "mincrypt/rsa.h"
+#include "mincrypt/sha.h"
+#include "mincrypt/sha256.h"
+#include "verifier_hash.h"
 
 typedef struct Certificate {
     int hash_len;  // SHA_DIGEST_SIZE (SHA-1) or SHA256_DIGEST_SIZE (SHA-256)
     RSAPublicKey* public_key;
 } Certificate;
 
-/* Look in the file for a signature footer, and verify that it
+/* Look in the mapped file for a signature footer, and verify that it
  * matches one of the given keys.  Return one of the constants below.
  */
-int verify_file(const char* path, const Certificate *pKeys, unsigned int numKeys);
+int verify_file(const unsigned char* addr, size_t length,
+                const Certificate *pKeys, unsigned int numKeys);
+
+/* Digests of the signed region of a package, computed elsewhere (for
+ * example while the package was being copied).
+ */
+typedef struct VerifierDigest {
+    size_t signed_len;  // number of leading bytes the digests cover
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    uint8_t sha256[SHA256_DIGEST_SIZE];
+} VerifierDigest;
+
+/* Given the last six bytes of a package of the given total length,
+ * return how many leading bytes the whole-file signature covers, or 0
+ * if the footer is malformed.
+ */
+size_t verifier_signed_length(const unsigned char* footer, size_t length);
+
+/* Like verify_file, but check the signature against a precomputed
+ * digest instead of hashing the mapping.  Fails if the digest doesn't
+ * cover exactly the region this package's signature says is signed.
+ */
+int verify_file_digest(const unsigned char* addr, size_t length,
+                       const VerifierDigest* digest,
+                       const Certificate *pKeys, unsigned int numKeys);
+
+/* Like verify_file, but also hand back the digests it computed, so a
+ * later check of the same file can use verify_file_digest().  Only
+ * the digests for the key types given are meaningful.
+ */
+int verify_file_and_digest(const unsigned char* addr, size_t length,
+                           const Certificate *pKeys, unsigned int numKeys,
+                           VerifierDigest* digest);
+
+/* Compute a VerifierDigest for a package that arrives as a stream
+ * (e.g. over adb), without knowing its length in advance.  Feed it all
+ * the bytes with verifier_stream_update(); verifier_stream_finish()
+ * then reads the footer and fills in the digest, or returns
+ * VERIFY_FAILURE if the footer is malformed.  Nothing is checked
+ * against any key until the digest is passed to verify_file_digest().
+ */
+#define VERIFIER_STREAM_TAIL (65535 + 2)  // largest comment, and its length
+
+typedef struct VerifierStream {
+    VerifierHashCtx sha1;
+    VerifierHashCtx sha256;
+    size_t length;                  // bytes seen so far
+    size_t tail_len;                // bytes in tail, not hashed yet
+    unsigned char tail[2 * VERIFIER_STREAM_TAIL];
+} VerifierStream;
+
+void verifier_stream_init(VerifierStream* stream);
+void verifier_stream_update(VerifierStream* stream, const void* data,
+                            size_t len);
+int verifier_stream_finish(VerifierStream* stream, VerifierDigest* digest);
+
+/* A hash tree carried in the package comment (see verifier.c), which
+ * lets the package be verified a chunk at a time as it is read.
+ */
+typedef struct VerifierHashTree {
+    const unsigned char* addr;  // the mapped package
+    size_t signed_len;          // bytes covered by the tree
+    size_t chunk_size;
+    size_t num_chunks;
+    const uint8_t* leaves;      // SHA-256 per chunk, inside the mapping
+    unsigned char* state;       // per-chunk check result
+    size_t next_chunk;          // next chunk for the background threads
+    pthread_mutex_t lock;
+    pthread_t* threads;
+    int num_threads;
+} VerifierHashTree;
+
+/* Look for a hash tree in the mapped package and check its signature
+ * against the given keys.  Returns VERIFY_SUCCESS if there is one and
+ * it is properly signed; the mapping must then outlive the tree.
+ */
+int verifier_open_hash_tree(const unsigned char* addr, size_t length,
+                            const Certificate *pKeys, unsigned int numKeys,
+                            VerifierHashTree* tree);
+
+/* Verify the chunks covering [offset, offset+length), hashing any not
+ * checked yet.  Has the signature of a ZipVerifyRangeFunction, with the
+ * tree as cookie.  Safe to call from several threads.
+ */
+bool verifier_hash_tree_check(size_t offset, size_t length, void* cookie);
+
+/* Start hashing every chunk in the background on the given number of
+ * threads, and wait for that to finish.  finish returns VERIFY_SUCCESS
+ * only if every chunk of the signed region matched.
+ */
+void verifier_hash_tree_start(VerifierHashTree* tree, int threads);
+int verifier_hash_tree_finish(VerifierHashTree* tree);
+
+void verifier_close_hash_tree(VerifierHashTree* tree);
 
 Certificate* load_keys(const char* filename, int* numKeys);
 
+/* A key store is the same set of certificates in a form that can be
+ * mapped and used in place:
+ *
+ *   "RCVKEYS1"      8-byte magic
+ *   num_keys        4 bytes
+ *   record_size     4 bytes, sizeof(KeyStoreRecord)
+ *   records         num_keys KeyStoreRecords
+ *
+ * All fields are native-endian 32-bit words; the store is generated at
+ * build time (by recovery_keystore, from the same dumpkey output as the
+ * text file) for the device it ships on.
+ */
+#define KEY_STORE_MAGIC "RCVKEYS1"
+#define KEY_STORE_HEADER_SIZE 16
+
+typedef struct {
+    int32_t hash_len;
+    RSAPublicKey key;
+} KeyStoreRecord;
+
+/* Load certificates from a binary key store.  The store is mapped once
+ * and the returned certificates point into it; free() only the array.
+ * Returns NULL if the file is missing or invalid, so callers can fall
+ * back to load_keys() on the text version.
+ */
+Certificate* load_key_store(const char* filename, int* numKeys);
+
 #define VERIFY_SUCCESS        0
 #define VERIFY_FAILURE        1
 
@@ -0,0 +1,204 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host benchmark for verify_file().  Times verification of packages
+// made by verifier_bench_sign under each I/O strategy and hash backend
+// and reports MB/s.  Exits nonzero if any verification fails, so it
+// doubles as a regression test.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "verifier.h"
+#include "verifier_hash.h"
+
+void ui_print(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+}
+
+void ui_set_progress(float fraction) {
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Drop the file's pages from the page cache so the next pass reads
+// from the disk.  Only works for clean pages, which these are once
+// written back.
+static void evict(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
+}
+
+enum { IO_MMAP, IO_MMAP_SEQUENTIAL, IO_READ };
+static const char* io_names[] = { "mmap", "mmap+seq", "read" };
+
+// Time one verification of path with the given I/O strategy.
+static int run_once(const char* path, int io, const Certificate* cert,
+                    double* seconds) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    size_t len = st.st_size;
+
+    double start = now();
+    unsigned char* addr;
+    if (io == IO_READ) {
+        addr = malloc(len);
+        size_t got = 0;
+        while (addr != NULL && got < len) {
+            ssize_t n = read(fd, addr + got, len - got);
+            if (n <= 0) break;
+            got += n;
+        }
+        if (addr == NULL || got != len) {
+            fprintf(stderr, "reading %s failed\n", path);
+            free(addr);
+            close(fd);
+            return -1;
+        }
+    } else {
+        addr = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED) {
+            fprintf(stderr, "mapping %s failed\n", path);
+            close(fd);
+            return -1;
+        }
+        if (io == IO_MMAP_SEQUENTIAL) {
+            madvise(addr, len, MADV_SEQUENTIAL);
+        }
+    }
+    close(fd);
+
+    int result = verify_file(addr, len, cert, 1);
+    *seconds = now() - start;
+
+    if (io == IO_READ) {
+        free(addr);
+    } else {
+        munmap(addr, len);
+    }
+    return result == VERIFY_SUCCESS ? 0 : -1;
+}
+
+static void usage(const char* argv0) {
+    fprintf(stderr,
+            "Usage: %s [-runs <n>] [-cold] <package> <keys> ...\n", argv0);
+}
+
+int main(int argc, char** argv) {
+    int runs = 3;
+    int cold = 0;
+    int i;
+
+    for (i = 1; i < argc && argv[i][0] == '-'; ++i) {
+        if (strcmp(argv[i], "-runs") == 0 && i + 1 < argc) {
+            runs = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-cold") == 0) {
+            cold = 1;
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (i == argc || (argc - i) % 2 != 0 || runs < 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    // verify_file() logs to stdout; keep that out of the results table
+    FILE* out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL || freopen("/dev/null", "w", stdout) == NULL) {
+        fprintf(stderr, "can't redirect stdout: %s\n", strerror(errno));
+        return 1;
+    }
+
+    static const char* backends[] = { "portable", "sha-ni", "armv8-ce" };
+    int failures = 0;
+
+    fprintf(out, "%-28s %-9s %-9s %10s\n", "package", "io", "hash", "MB/s");
+    for (; i < argc; i += 2) {
+        const char* path = argv[i];
+        struct stat st;
+        int num_keys;
+        Certificate* certs = load_keys(argv[i + 1], &num_keys);
+        if (certs == NULL || num_keys != 1) {
+            fprintf(stderr, "%s: need exactly one key\n", argv[i + 1]);
+            return 1;
+        }
+        if (stat(path, &st) != 0) {
+            fprintf(stderr, "can't stat %s: %s\n", path, strerror(errno));
+            return 1;
+        }
+        double size_mb = st.st_size / (1024.0 * 1024.0);
+
+        size_t b;
+        for (b = 0; b < sizeof(backends) / sizeof(backends[0]); ++b) {
+            if (verifier_hash_select_backend(backends[b]) != 0) {
+                continue;       // not built in, or not on this CPU
+            }
+            int io;
+            for (io = IO_MMAP; io <= IO_READ; ++io) {
+                double best = 0;
+                int r;
+                for (r = 0; r < runs; ++r) {
+                    double seconds;
+                    if (cold) evict(path);
+                    if (run_once(path, io, certs, &seconds) != 0) {
+                        fprintf(stderr, "%s: verification failed (%s, %s)\n",
+                                path, io_names[io], backends[b]);
+                        ++failures;
+                        break;
+                    }
+                    if (best == 0 || seconds < best) best = seconds;
+                }
+                if (best > 0) {
+                    fprintf(out, "%-28s %-9s %-9s %10.1f\n", path, io_names[io],
+                           backends[b], size_mb / best);
+                }
+            }
+        }
+        verifier_hash_select_backend(NULL);
+        free(certs[0].public_key);
+        free(certs);
+    }
+
+    fclose(out);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Host tool: write the synthetic package verifier_bench times, signed
+// whole-file with a testdata .pk8 key, and the key's public half in
+// dumpkey format for verifier_bench to load with load_keys().  It uses
+// only OpenSSL, and verifier_bench only mincrypt, so no binary links
+// two definitions of RSA_verify.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <openssl/bn.h>
+#include <openssl/evp.h>
+#include <openssl/objects.h>
+#include <openssl/rsa.h>
+#include <openssl/x509.h>
+
+#define NUM_WORDS 64        // mincrypt's RSANUMWORDS: 2048-bit keys
+#define SIG_BYTES (NUM_WORDS * 4)
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+static void RSA_get0_key(const RSA* r, const BIGNUM** n, const BIGNUM** e,
+                         const BIGNUM** d) {
+    if (n) *n = r->n;
+    if (e) *e = r->e;
+    if (d) *d = r->d;
+}
+#endif
+
+typedef struct {
+    RSA* rsa;
+    int hash_len;           // 20 for SHA-1, 32 for SHA-256
+} BenchKey;
+
+// Parse "<key.pk8>[:sha256]" and load the key.
+static int load_key(const char* spec, BenchKey* key) {
+    char path[PATH_MAX];
+    strncpy(path, spec, sizeof(path) - 1);
+    path[sizeof(path) - 1] = '\0';
+    key->hash_len = 20;
+    char* colon = strrchr(path, ':');
+    if (colon != NULL && strcmp(colon, ":sha256") == 0) {
+        *colon = '\0';
+        key->hash_len = 32;
+    }
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    EVP_PKEY* pkey = d2i_PrivateKey_fp(f, NULL);
+    fclose(f);
+    key->rsa = pkey != NULL ? EVP_PKEY_get1_RSA(pkey) : NULL;
+    EVP_PKEY_free(pkey);
+    if (key->rsa == NULL) {
+        fprintf(stderr, "%s is not an RSA PKCS#8 key\n", path);
+        return -1;
+    }
+    if (RSA_size(key->rsa) != SIG_BYTES) {
+        fprintf(stderr, "%s: key is not %d bits\n", path, NUM_WORDS * 32);
+        RSA_free(key->rsa);
+        return -1;
+    }
+    return 0;
+}
+
+// Write the public half the way dumpkey does, so recovery's own
+// load_keys() reads it.
+static int write_public_key(const char* path, const BenchKey* key) {
+    const BIGNUM* bn_n;
+    const BIGNUM* bn_e;
+    RSA_get0_key(key->rsa, &bn_n, &bn_e, NULL);
+    int exponent = BN_get_word(bn_e);
+    if (exponent != 3 && exponent != 65537) {
+        fprintf(stderr, "unsupported exponent %d\n", exponent);
+        return -1;
+    }
+
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM* r32 = BN_new();
+    BIGNUM* tmp = BN_new();
+    BIGNUM* rr = BN_new();
+    BIGNUM* nn = BN_dup(bn_n);
+    BN_set_bit(r32, 32);
+
+    // n0inv = -1 / n[0] mod 2^32
+    BN_nnmod(tmp, bn_n, r32, ctx);
+    BN_mod_inverse(tmp, tmp, r32, ctx);
+    BN_sub(tmp, r32, tmp);
+    uint32_t n0inv = BN_get_word(tmp);
+
+    // rr = (2^(NUM_WORDS*32))^2 mod n
+    BN_zero(rr);
+    BN_set_bit(rr, NUM_WORDS * 32 * 2);
+    BN_nnmod(rr, rr, bn_n, ctx);
+
+    uint32_t n_words[NUM_WORDS], rr_words[NUM_WORDS];
+    int i;
+    for (i = 0; i < NUM_WORDS; ++i) {
+        BN_nnmod(tmp, nn, r32, ctx);
+        n_words[i] = BN_get_word(tmp);
+        BN_rshift(nn, nn, 32);
+        BN_nnmod(tmp, rr, r32, ctx);
+        rr_words[i] = BN_get_word(tmp);
+        BN_rshift(rr, rr, 32);
+    }
+    BN_free(nn);
+    BN_free(rr);
+    BN_free(tmp);
+    BN_free(r32);
+    BN_CTX_free(ctx);
+
+    FILE* f = fopen(path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "can't create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    // version 1 (e=3, SHA-1) has no prefix; see load_keys()
+    int version = (exponent == 65537 ? 2 : 1) + (key->hash_len == 32 ? 2 : 0);
+    if (version > 1) fprintf(f, "v%d ", version);
+    fprintf(f, "{%d,0x%x,{", NUM_WORDS, n0inv);
+    for (i = 0; i < NUM_WORDS; ++i) {
+        fprintf(f, "%s%u", i ? "," : "", n_words[i]);
+    }
+    fprintf(f, "},{");
+    for (i = 0; i < NUM_WORDS; ++i) {
+        fprintf(f, "%s%u", i ? "," : "", rr_words[i]);
+    }
+    fprintf(f, "}}");
+    if (ferror(f) | fclose(f)) {
+        fprintf(stderr, "writing %s failed\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+static void put2(unsigned char* p, unsigned v) {
+    p[0] = v;
+    p[1] = v >> 8;
+}
+
+static void put4(unsigned char* p, uint32_t v) {
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+}
+
+// Write a package of about size_mb megabytes: one STORED entry of
+// pseudo-random data, its central directory record and an EOCD whose
+// comment holds the whole-file signature, as signapk -w lays it out.
+static int make_package(const char* path, size_t size_mb, const BenchKey* key) {
+    static const char name[] = "payload";
+    const size_t name_len = sizeof(name) - 1;
+    size_t data_len = size_mb * 1024 * 1024;
+    size_t loc_len = 30 + name_len;
+    size_t cd_len = 46 + name_len;
+    size_t comment_len = SIG_BYTES + 6;
+    size_t total = loc_len + data_len + cd_len + 22 + comment_len;
+
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, total) != 0) {
+        fprintf(stderr, "can't create %s: %s\n", path, strerror(errno));
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    unsigned char* p = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "can't map %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    // xorshift fill; fast and incompressible enough
+    uint64_t x = 0x9e3779b97f4a7c15ULL;
+    unsigned char* data = p + loc_len;
+    size_t i;
+    for (i = 0; i + 8 <= data_len; i += 8) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        memcpy(data + i, &x, 8);
+    }
+
+    unsigned char* loc = p;
+    put4(loc, 0x04034b50);
+    put2(loc + 4, 10);
+    put2(loc + 8, 0);                   // STORED
+    put4(loc + 18, data_len);
+    put4(loc + 22, data_len);
+    put2(loc + 26, name_len);
+    memcpy(loc + 30, name, name_len);
+
+    unsigned char* cd = data + data_len;
+    put4(cd, 0x02014b50);
+    put2(cd + 4, 10);
+    put2(cd + 6, 10);
+    put4(cd + 20, data_len);
+    put4(cd + 24, data_len);
+    put2(cd + 28, name_len);
+    memcpy(cd + 46, name, name_len);
+
+    unsigned char* eocd = cd + cd_len;
+    put4(eocd, 0x06054b50);
+    put2(eocd + 8, 1);
+    put2(eocd + 10, 1);
+    put4(eocd + 12, cd_len);
+    put4(eocd + 16, loc_len + data_len);
+    put2(eocd + 20, comment_len);
+
+    // everything up to (not including) the comment length is signed
+    size_t signed_len = eocd + 20 - p;
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_len = 0;
+    unsigned int sig_len = 0;
+    int sha256 = key->hash_len == 32;
+    unsigned char* comment = eocd + 22;
+    int ok = EVP_Digest(p, signed_len, digest, &digest_len,
+                        sha256 ? EVP_sha256() : EVP_sha1(), NULL) &&
+             RSA_sign(sha256 ? NID_sha256 : NID_sha1, digest, digest_len,
+                      comment, &sig_len, key->rsa) &&
+             sig_len == SIG_BYTES;
+    unsigned char* footer = comment + SIG_BYTES;
+    put2(footer, comment_len);          // signature start, from the end
+    footer[2] = 0xff;
+    footer[3] = 0xff;
+    put2(footer + 4, comment_len);
+
+    munmap(p, total);
+    if (!ok) {
+        fprintf(stderr, "signing %s failed\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    size_t size_mb = 256;
+    int i = 1;
+    if (i + 1 < argc && strcmp(argv[i], "-size") == 0) {
+        size_mb = strtoul(argv[i + 1], NULL, 10);
+        i += 2;
+    }
+    if (argc - i != 3 || size_mb == 0) {
+        fprintf(stderr,
+                "Usage: %s [-size <MB>] <key.pk8>[:sha256] <package> <keys>\n",
+                argv[0]);
+        return 2;
+    }
+
+    BenchKey key;
+    if (load_key(argv[i], &key) != 0) {
+        return 1;
+    }
+    int ok = make_package(argv[i + 1], size_mb, &key) == 0 &&
+             write_public_key(argv[i + 2], &key) == 0;
+    RSA_free(key.rsa);
+    if (!ok) {
+        unlink(argv[i + 1]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,654 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "verifier_hash.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#if defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+#define HAVE_SHA_NI 1
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#endif
+
+#if defined(__ARM_FEATURE_CRYPTO) && (defined(__aarch64__) || defined(__arm__))
+#define HAVE_ARMV8_CE 1
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+
+#define SHA1_DIGEST_LEN 20
+#define SHA256_DIGEST_LEN 32
+
+static const uint32_t sha1_iv[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+static const uint32_t sha1_k[4] = {
+    0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6
+};
+
+static const uint32_t sha256_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+    0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline uint32_t load_be32(const uint8_t* p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline void store_be32(uint8_t* p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+// ------------------------------------------------------------------
+// portable C
+
+static void sha1_blocks_portable(uint32_t* state, const uint8_t* data,
+                                 size_t nblocks) {
+    uint32_t w[80];
+    int i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; ++i) w[i] = load_be32(data + i * 4);
+        for (; i < 80; ++i) w[i] = ROL(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+        uint32_t a = state[0], b = state[1], c = state[2];
+        uint32_t d = state[3], e = state[4];
+        for (i = 0; i < 80; ++i) {
+            uint32_t f;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+            } else {
+                f = b ^ c ^ d;
+            }
+            uint32_t t = ROL(a, 5) + f + e + sha1_k[i / 20] + w[i];
+            e = d;
+            d = c;
+            c = ROL(b, 30);
+            b = a;
+            a = t;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        data += 64;
+    }
+}
+
+static void sha256_blocks_portable(uint32_t* state, const uint8_t* data,
+                                   size_t nblocks) {
+    uint32_t w[64];
+    int i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; ++i) w[i] = load_be32(data + i * 4);
+        for (; i < 64; ++i) {
+            uint32_t s0 = ROR(w[i-15], 7) ^ ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = ROR(w[i-2], 17) ^ ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (i = 0; i < 64; ++i) {
+            uint32_t s1 = ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25);
+            uint32_t ch = (e & f) ^ (~e & g);
+            uint32_t t1 = h + s1 + ch + sha256_k[i] + w[i];
+            uint32_t s0 = ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22);
+            uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t t2 = s0 + maj;
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        data += 64;
+    }
+}
+
+// ------------------------------------------------------------------
+// x86 SHA extensions
+
+#ifdef HAVE_SHA_NI
+
+static int cpu_has_sha_ni() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+        return 0;
+    // SSSE3 and SSE4.1 are needed for the byte shuffles and blends
+    if (!(ecx & (1 << 9)) || !(ecx & (1 << 19)))
+        return 0;
+    if (__get_cpuid_max(0, NULL) < 7)
+        return 0;
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & (1 << 29)) != 0;
+}
+
+// four rounds, with the message schedule for later rounds interleaved
+#define SHA1_NI_ROUNDS(E, E_NEXT, X, M1, M2, M3, f)   \
+    E = _mm_sha1nexte_epu32(E, X);                    \
+    E_NEXT = abcd;                                    \
+    M1 = _mm_sha1msg2_epu32(M1, X);                   \
+    abcd = _mm_sha1rnds4_epu32(abcd, E, f);           \
+    M3 = _mm_sha1msg1_epu32(M3, X);                   \
+    M2 = _mm_xor_si128(M2, X);
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha1_blocks_sha_ni(uint32_t* state, const uint8_t* data,
+                               size_t nblocks) {
+    const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL,
+                                        0x08090a0b0c0d0e0fULL);
+    __m128i abcd, abcd_save, e0, e0_save, e1;
+    __m128i m0, m1, m2, m3;
+
+    abcd = _mm_loadu_si128((const __m128i*)state);
+    e0 = _mm_set_epi32(state[4], 0, 0, 0);
+    abcd = _mm_shuffle_epi32(abcd, 0x1b);
+
+    while (nblocks--) {
+        abcd_save = abcd;
+        e0_save = e0;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), mask);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+
+        // rounds 0-15
+        e0 = _mm_add_epi32(e0, m0);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+        m0 = _mm_sha1msg1_epu32(m0, m1);
+
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+        m1 = _mm_sha1msg1_epu32(m1, m2);
+        m0 = _mm_xor_si128(m0, m2);
+
+        SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 0);
+
+        // rounds 16-67
+        SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 0);
+        SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+        SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 1);
+        SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 1);
+        SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 1);
+        SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 1);
+        SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+        SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 2);
+        SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 2);
+        SHA1_NI_ROUNDS(e1, e0, m1, m2, m3, m0, 2);
+        SHA1_NI_ROUNDS(e0, e1, m2, m3, m0, m1, 2);
+        SHA1_NI_ROUNDS(e1, e0, m3, m0, m1, m2, 3);
+        SHA1_NI_ROUNDS(e0, e1, m0, m1, m2, m3, 3);
+
+        // rounds 68-79
+        e1 = _mm_sha1nexte_epu32(e1, m1);
+        e0 = abcd;
+        m2 = _mm_sha1msg2_epu32(m2, m1);
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+        m3 = _mm_xor_si128(m3, m1);
+
+        e0 = _mm_sha1nexte_epu32(e0, m2);
+        e1 = abcd;
+        m3 = _mm_sha1msg2_epu32(m3, m2);
+        abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+        e1 = _mm_sha1nexte_epu32(e1, m3);
+        e0 = abcd;
+        abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+        e0 = _mm_sha1nexte_epu32(e0, e0_save);
+        abcd = _mm_add_epi32(abcd, abcd_save);
+
+        data += 64;
+    }
+
+    abcd = _mm_shuffle_epi32(abcd, 0x1b);
+    _mm_storeu_si128((__m128i*)state, abcd);
+    state[4] = _mm_extract_epi32(e0, 3);
+}
+
+// four rounds; N gets its message schedule finished, P gets it started
+#define SHA256_NI_ROUNDS(X, P, N, g)                                       \
+    msg = _mm_add_epi32(X, _mm_loadu_si128((const __m128i*)&sha256_k[4 * (g)])); \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                   \
+    tmp = _mm_alignr_epi8(X, P, 4);                                        \
+    N = _mm_add_epi32(N, tmp);                                             \
+    N = _mm_sha256msg2_epu32(N, X);                                        \
+    msg = _mm_shuffle_epi32(msg, 0x0e);                                    \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);                   \
+    P = _mm_sha256msg1_epu32(P, X);
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_blocks_sha_ni(uint32_t* state, const uint8_t* data,
+                                 size_t nblocks) {
+    const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                        0x0405060700010203ULL);
+    __m128i state0, state1, abef_save, cdgh_save;
+    __m128i msg, tmp, m0, m1, m2, m3;
+
+    tmp = _mm_loadu_si128((const __m128i*)&state[0]);
+    state1 = _mm_loadu_si128((const __m128i*)&state[4]);
+    tmp = _mm_shuffle_epi32(tmp, 0xb1);             // CDAB
+    state1 = _mm_shuffle_epi32(state1, 0x1b);       // EFGH
+    state0 = _mm_alignr_epi8(tmp, state1, 8);       // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xf0);    // CDGH
+
+    while (nblocks--) {
+        abef_save = state0;
+        cdgh_save = state1;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 0)), mask);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 16)), mask);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 32)), mask);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data + 48)), mask);
+
+        // rounds 0-11
+        msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i*)&sha256_k[0]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        msg = _mm_shuffle_epi32(msg, 0x0e);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+        msg = _mm_add_epi32(m1, _mm_loadu_si128((const __m128i*)&sha256_k[4]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        msg = _mm_shuffle_epi32(msg, 0x0e);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        m0 = _mm_sha256msg1_epu32(m0, m1);
+
+        msg = _mm_add_epi32(m2, _mm_loadu_si128((const __m128i*)&sha256_k[8]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        msg = _mm_shuffle_epi32(msg, 0x0e);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+        m1 = _mm_sha256msg1_epu32(m1, m2);
+
+        // rounds 12-51
+        SHA256_NI_ROUNDS(m3, m2, m0, 3);
+        SHA256_NI_ROUNDS(m0, m3, m1, 4);
+        SHA256_NI_ROUNDS(m1, m0, m2, 5);
+        SHA256_NI_ROUNDS(m2, m1, m3, 6);
+        SHA256_NI_ROUNDS(m3, m2, m0, 7);
+        SHA256_NI_ROUNDS(m0, m3, m1, 8);
+        SHA256_NI_ROUNDS(m1, m0, m2, 9);
+        SHA256_NI_ROUNDS(m2, m1, m3, 10);
+        SHA256_NI_ROUNDS(m3, m2, m0, 11);
+        SHA256_NI_ROUNDS(m0, m3, m1, 12);
+
+        // rounds 52-63
+        msg = _mm_add_epi32(m1, _mm_loadu_si128((const __m128i*)&sha256_k[52]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        tmp = _mm_alignr_epi8(m1, m0, 4);
+        m2 = _mm_add_epi32(m2, tmp);
+        m2 = _mm_sha256msg2_epu32(m2, m1);
+        msg = _mm_shuffle_epi32(msg, 0x0e);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+        msg = _mm_add_epi32(m2, _mm_loadu_si128((const __m128i*)&sha256_k[56]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        tmp = _mm_alignr_epi8(m2, m1, 4);
+        m3 = _mm_add_epi32(m3, tmp);
+        m3 = _mm_sha256msg2_epu32(m3, m2);
+        msg = _mm_shuffle_epi32(msg, 0x0e);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+        msg = _mm_add_epi32(m3, _mm_loadu_si128((const __m128i*)&sha256_k[60]));
+        state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+        msg = _mm_shuffle_epi32(msg, 0x0e);
+        state0 = _mm_sha256rnds2_epu32(state0, state1, msg);
+
+        state0 = _mm_add_epi32(state0, abef_save);
+        state1 = _mm_add_epi32(state1, cdgh_save);
+
+        data += 64;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1b);          // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xb1);       // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xf0);    // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);       // ABEF
+
+    _mm_storeu_si128((__m128i*)&state[0], state0);
+    _mm_storeu_si128((__m128i*)&state[4], state1);
+}
+
+#endif  // HAVE_SHA_NI
+
+// ------------------------------------------------------------------
+// ARMv8 crypto extensions
+
+#ifdef HAVE_ARMV8_CE
+
+#ifdef __aarch64__
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+static int cpu_has_armv8_sha1() { return (getauxval(AT_HWCAP) & HWCAP_SHA1) != 0; }
+static int cpu_has_armv8_sha2() { return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0; }
+#else
+#ifndef HWCAP2_SHA1
+#define HWCAP2_SHA1 (1 << 2)
+#endif
+#ifndef HWCAP2_SHA2
+#define HWCAP2_SHA2 (1 << 3)
+#endif
+static int cpu_has_armv8_sha1() { return (getauxval(AT_HWCAP2) & HWCAP2_SHA1) != 0; }
+static int cpu_has_armv8_sha2() { return (getauxval(AT_HWCAP2) & HWCAP2_SHA2) != 0; }
+#endif
+
+static inline uint32x4_t load_be32x4(const uint8_t* p) {
+    return vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(p)));
+}
+
+// four rounds of group g; m0 is consumed and replaced by the schedule
+// for g + 4 while m1..m3 are the following message words
+#define SHA1_CE_ROUNDS(OP, m0, m1, m2, m3, g)                 \
+    tmp = vaddq_u32(m0, vdupq_n_u32(sha1_k[(g) / 5]));        \
+    e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));             \
+    abcd = OP(abcd, e, tmp);                                  \
+    e = e_next;                                               \
+    if ((g) < 16)                                             \
+        m0 = vsha1su1q_u32(vsha1su0q_u32(m0, m1, m2), m3);
+
+static void sha1_blocks_armv8(uint32_t* state, const uint8_t* data,
+                              size_t nblocks) {
+    uint32x4_t abcd = vld1q_u32(state);
+    uint32_t e = state[4];
+
+    while (nblocks--) {
+        uint32x4_t abcd_save = abcd;
+        uint32_t e_save = e;
+        uint32_t e_next;
+        uint32x4_t tmp;
+
+        uint32x4_t m0 = load_be32x4(data + 0);
+        uint32x4_t m1 = load_be32x4(data + 16);
+        uint32x4_t m2 = load_be32x4(data + 32);
+        uint32x4_t m3 = load_be32x4(data + 48);
+
+        SHA1_CE_ROUNDS(vsha1cq_u32, m0, m1, m2, m3, 0);
+        SHA1_CE_ROUNDS(vsha1cq_u32, m1, m2, m3, m0, 1);
+        SHA1_CE_ROUNDS(vsha1cq_u32, m2, m3, m0, m1, 2);
+        SHA1_CE_ROUNDS(vsha1cq_u32, m3, m0, m1, m2, 3);
+        SHA1_CE_ROUNDS(vsha1cq_u32, m0, m1, m2, m3, 4);
+        SHA1_CE_ROUNDS(vsha1pq_u32, m1, m2, m3, m0, 5);
+        SHA1_CE_ROUNDS(vsha1pq_u32, m2, m3, m0, m1, 6);
+        SHA1_CE_ROUNDS(vsha1pq_u32, m3, m0, m1, m2, 7);
+        SHA1_CE_ROUNDS(vsha1pq_u32, m0, m1, m2, m3, 8);
+        SHA1_CE_ROUNDS(vsha1pq_u32, m1, m2, m3, m0, 9);
+        SHA1_CE_ROUNDS(vsha1mq_u32, m2, m3, m0, m1, 10);
+        SHA1_CE_ROUNDS(vsha1mq_u32, m3, m0, m1, m2, 11);
+        SHA1_CE_ROUNDS(vsha1mq_u32, m0, m1, m2, m3, 12);
+        SHA1_CE_ROUNDS(vsha1mq_u32, m1, m2, m3, m0, 13);
+        SHA1_CE_ROUNDS(vsha1mq_u32, m2, m3, m0, m1, 14);
+        SHA1_CE_ROUNDS(vsha1pq_u32, m3, m0, m1, m2, 15);
+        SHA1_CE_ROUNDS(vsha1pq_u32, m0, m1, m2, m3, 16);
+        SHA1_CE_ROUNDS(vsha1pq_u32, m1, m2, m3, m0, 17);
+        SHA1_CE_ROUNDS(vsha1pq_u32, m2, m3, m0, m1, 18);
+        SHA1_CE_ROUNDS(vsha1pq_u32, m3, m0, m1, m2, 19);
+
+        abcd = vaddq_u32(abcd, abcd_save);
+        e += e_save;
+        data += 64;
+    }
+
+    vst1q_u32(state, abcd);
+    state[4] = e;
+}
+
+// four rounds of group g; m0 is consumed and replaced by the schedule
+// for g + 4 while m1..m3 are the following message words
+#define SHA256_CE_ROUNDS(m0, m1, m2, m3, g)                   \
+    tmp = vaddq_u32(m0, vld1q_u32(&sha256_k[4 * (g)]));       \
+    if ((g) < 12)                                             \
+        m0 = vsha256su1q_u32(vsha256su0q_u32(m0, m1), m2, m3);\
+    save = state0;                                            \
+    state0 = vsha256hq_u32(state0, state1, tmp);              \
+    state1 = vsha256h2q_u32(state1, save, tmp);
+
+static void sha256_blocks_armv8(uint32_t* state, const uint8_t* data,
+                                size_t nblocks) {
+    uint32x4_t state0 = vld1q_u32(&state[0]);
+    uint32x4_t state1 = vld1q_u32(&state[4]);
+
+    while (nblocks--) {
+        uint32x4_t abef_save = state0;
+        uint32x4_t cdgh_save = state1;
+        uint32x4_t tmp, save;
+
+        uint32x4_t m0 = load_be32x4(data + 0);
+        uint32x4_t m1 = load_be32x4(data + 16);
+        uint32x4_t m2 = load_be32x4(data + 32);
+        uint32x4_t m3 = load_be32x4(data + 48);
+
+        SHA256_CE_ROUNDS(m0, m1, m2, m3, 0);
+        SHA256_CE_ROUNDS(m1, m2, m3, m0, 1);
+        SHA256_CE_ROUNDS(m2, m3, m0, m1, 2);
+        SHA256_CE_ROUNDS(m3, m0, m1, m2, 3);
+        SHA256_CE_ROUNDS(m0, m1, m2, m3, 4);
+        SHA256_CE_ROUNDS(m1, m2, m3, m0, 5);
+        SHA256_CE_ROUNDS(m2, m3, m0, m1, 6);
+        SHA256_CE_ROUNDS(m3, m0, m1, m2, 7);
+        SHA256_CE_ROUNDS(m0, m1, m2, m3, 8);
+        SHA256_CE_ROUNDS(m1, m2, m3, m0, 9);
+        SHA256_CE_ROUNDS(m2, m3, m0, m1, 10);
+        SHA256_CE_ROUNDS(m3, m0, m1, m2, 11);
+        SHA256_CE_ROUNDS(m0, m1, m2, m3, 12);
+        SHA256_CE_ROUNDS(m1, m2, m3, m0, 13);
+        SHA256_CE_ROUNDS(m2, m3, m0, m1, 14);
+        SHA256_CE_ROUNDS(m3, m0, m1, m2, 15);
+
+        state0 = vaddq_u32(state0, abef_save);
+        state1 = vaddq_u32(state1, cdgh_save);
+        data += 64;
+    }
+
+    vst1q_u32(&state[0], state0);
+    vst1q_u32(&state[4], state1);
+}
+
+#endif  // HAVE_ARMV8_CE
+
+// ------------------------------------------------------------------
+// backend selection
+
+typedef struct {
+    const char* name;
+    VerifierHashBlocks sha1;
+    VerifierHashBlocks sha256;
+} HashBackend;
+
+static const HashBackend portable_backend = {
+    "portable", sha1_blocks_portable, sha256_blocks_portable
+};
+
+static HashBackend selected_backend;
+static int backend_initialized = 0;
+
+static int find_backend(const char* name, HashBackend* out) {
+    *out = portable_backend;
+    if (name != NULL && strcmp(name, "portable") == 0)
+        return 0;
+#ifdef HAVE_ARMV8_CE
+    if (name == NULL || strcmp(name, "armv8-ce") == 0) {
+        int sha1 = cpu_has_armv8_sha1();
+        int sha2 = cpu_has_armv8_sha2();
+        if (sha1 || sha2) {
+            out->name = "armv8-ce";
+            if (sha1) out->sha1 = sha1_blocks_armv8;
+            if (sha2) out->sha256 = sha256_blocks_armv8;
+            return 0;
+        }
+    }
+#endif
+#ifdef HAVE_SHA_NI
+    if (name == NULL || strcmp(name, "sha-ni") == 0) {
+        if (cpu_has_sha_ni()) {
+            out->name = "sha-ni";
+            out->sha1 = sha1_blocks_sha_ni;
+            out->sha256 = sha256_blocks_sha_ni;
+            return 0;
+        }
+    }
+#endif
+    return name == NULL ? 0 : -1;
+}
+
+static const HashBackend* get_backend() {
+    if (!backend_initialized) {
+        find_backend(NULL, &selected_backend);
+        backend_initialized = 1;
+    }
+    return &selected_backend;
+}
+
+int verifier_hash_select_backend(const char* name) {
+    HashBackend backend;
+    if (find_backend(name, &backend) != 0)
+        return -1;
+    selected_backend = backend;
+    backend_initialized = 1;
+    return 0;
+}
+
+const char* verifier_hash_backend(int digest_len) {
+    const HashBackend* backend = get_backend();
+    VerifierHashBlocks blocks =
+            digest_len == SHA1_DIGEST_LEN ? backend->sha1 : backend->sha256;
+    if (blocks == sha1_blocks_portable || blocks == sha256_blocks_portable)
+        return portable_backend.name;
+    return backend->name;
+}
+
+// ------------------------------------------------------------------
+// streaming interface
+
+void verifier_hash_init(VerifierHashCtx* ctx, int digest_len) {
+    const HashBackend* backend = get_backend();
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->digest_len = digest_len;
+    if (digest_len == SHA1_DIGEST_LEN) {
+        memcpy(ctx->state, sha1_iv, sizeof(sha1_iv));
+        ctx->blocks = backend->sha1;
+    } else {
+        memcpy(ctx->state, sha256_iv, sizeof(sha256_iv));
+        ctx->blocks = backend->sha256;
+    }
+}
+
+void verifier_hash_update(VerifierHashCtx* ctx, const void* data, size_t len) {
+    const uint8_t* p = (const uint8_t*)data;
+    size_t used = ctx->count & 63;
+
+    ctx->count += len;
+
+    if (used) {
+        size_t n = 64 - used;
+        if (n > len) n = len;
+        memcpy(ctx->buf + used, p, n);
+        p += n;
+        len -= n;
+        if (used + n < 64)
+            return;
+        ctx->blocks(ctx->state, ctx->buf, 1);
+    }
+
+    // whole blocks go straight from the caller's buffer
+    if (len >= 64) {
+        ctx->blocks(ctx->state, p, len / 64);
+        p += len & ~(size_t)63;
+        len &= 63;
+    }
+
+    if (len)
+        memcpy(ctx->buf, p, len);
+}
+
+const uint8_t* verifier_hash_final(VerifierHashCtx* ctx) {
+    uint64_t bits = ctx->count * 8;
+    size_t used = ctx->count & 63;
+    int i;
+
+    ctx->buf[used++] = 0x80;
+    if (used > 56) {
+        memset(ctx->buf + used, 0, 64 - used);
+        ctx->blocks(ctx->state, ctx->buf, 1);
+        used = 0;
+    }
+    memset(ctx->buf + used, 0, 56 - used);
+    for (i = 0; i < 8; ++i)
+        ctx->buf[56 + i] = bits >> (56 - 8 * i);
+    ctx->blocks(ctx->state, ctx->buf, 1);
+
+    for (i = 0; i < ctx->digest_len / 4; ++i)
+        store_be32(ctx->digest + i * 4, ctx->state[i]);
+    return ctx->digest;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _RECOVERY_VERIFIER_HASH_H
+#define _RECOVERY_VERIFIER_HASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Streaming SHA-1 / SHA-256 used to hash whole packages.
+ *
+ * The compression function is picked at runtime: ARMv8 crypto extensions
+ * or x86 SHA-NI when the CPU has them (and the build enabled them), the
+ * portable C version otherwise.  The digests are identical either way.
+ */
+
+#define VERIFIER_HASH_MAX_DIGEST 32
+
+typedef void (*VerifierHashBlocks)(uint32_t* state, const uint8_t* data,
+                                   size_t nblocks);
+
+typedef struct VerifierHashCtx {
+    uint32_t state[8];
+    uint64_t count;         // bytes hashed so far
+    uint8_t buf[64];
+    uint8_t digest[VERIFIER_HASH_MAX_DIGEST];
+    int digest_len;         // SHA_DIGEST_SIZE (20) or SHA256_DIGEST_SIZE (32)
+    VerifierHashBlocks blocks;
+} VerifierHashCtx;
+
+/* digest_len selects the algorithm: 20 for SHA-1, 32 for SHA-256. */
+void verifier_hash_init(VerifierHashCtx* ctx, int digest_len);
+void verifier_hash_update(VerifierHashCtx* ctx, const void* data, size_t len);
+const uint8_t* verifier_hash_final(VerifierHashCtx* ctx);
+
+/* Name of the backend used for the given digest length:
+ * "armv8-ce", "sha-ni" or "portable".
+ */
+const char* verifier_hash_backend(int digest_len);
+
+/* Force a backend by name, or NULL to go back to automatic selection.
+ * Returns 0 on success, -1 if the backend is unknown or unsupported by
+ * this CPU.  Meant for tests and benchmarks.
+ */
+int verifier_hash_select_backend(const char* name);
+
+#endif  /* _RECOVERY_VERIFIER_HASH_H */
@@ -19,6 +19,7 @@
 #include <stdarg.h>
 
 #include "verifier.h"
+#include "minzip/SysUtil.h"
 #include "mincrypt/sha.h"
 #include "mincrypt/sha256.h"
 
@@ -112,8 +113,8 @@ void ui_set_progress(float fraction) {
 }
 
 int main(int argc, char **argv) {
-    if (argc < 2 || argc > 4) {
-        fprintf(stderr, "Usage: %s [-sha256] [-f4 | -file <keys>] <package>\n", argv[0]);
+    if (argc < 2 || argc > 5) {
+        fprintf(stderr, "Usage: %s [-tree] [-sha256] [-f4 | -file <keys>] <package>\n", argv[0]);
         return 2;
     }
 
@@ -123,6 +124,13 @@ int main(int argc, char **argv) {
     cert->hash_len = SHA_DIGEST_SIZE;
     int num_keys = 1;
     ++argv;
+    // verify with the package's hash tree instead of its whole-file
+    // signature
+    int use_tree = 0;
+    if (strcmp(argv[0], "-tree") == 0) {
+        ++argv;
+        use_tree = 1;
+    }
     if (strcmp(argv[0], "-sha256") == 0) {
         ++argv;
         cert->hash_len = SHA256_DIGEST_SIZE;
@@ -136,7 +144,26 @@ int main(int argc, char **argv) {
         ++argv;
     }
 
-    int result = verify_file(*argv, cert, num_keys);
+    MemMapping map;
+    if (sysMapFile(*argv, &map) != 0) {
+        fprintf(stderr, "failed to map %s\n", *argv);
+        return 4;
+    }
+
+    int result;
+    if (use_tree) {
+        VerifierHashTree tree;
+        result = verifier_open_hash_tree(map.addr, map.length, cert, num_keys,
+                                         &tree);
+        if (result == VERIFY_SUCCESS) {
+            verifier_hash_tree_start(&tree, 2);
+            result = verifier_hash_tree_finish(&tree);
+            verifier_close_hash_tree(&tree);
+        }
+    } else {
+        result = verify_file(map.addr, map.length, cert, num_keys);
+    }
+    sysReleaseShmem(&map);
     if (result == VERIFY_SUCCESS) {
         printf("VERIFIED\n");
         return 0;
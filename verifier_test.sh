@@ -102,6 +102,21 @@ expect_fail fake-eocd.zip
 expect_fail alter-metadata.zip
 expect_fail alter-footer.zip
 
+# packages with a hash tree in the comment (tools/ota/add_hash_tree.py),
+# verified through the tree with -tree
+expect_succeed hashtree.zip
+expect_succeed hashtree.zip -tree
+expect_fail hashtree.zip -tree -f4
+expect_fail otasigned.zip -tree
+# one byte flipped in the second chunk
+expect_fail hashtree-alter-chunk.zip -tree
+expect_fail hashtree-alter-chunk.zip
+# tree signature corrupted; the whole-file one still holds
+expect_fail hashtree-bad-signature.zip -tree
+expect_succeed hashtree-bad-signature.zip
+# properly signed tree that claims a shorter signed region
+expect_fail hashtree-wrong-length.zip -tree
+
 # --------------- cleanup ----------------------
 
 cleanup